@@ -262,6 +262,66 @@ void Com_Printf (msg_level_t msg_level, const char* format, ...)
 }
 
 
+/*
+====================
+Com_SipHash
+
+Compute the SipHash-2-4 MAC of a message
+====================
+*/
+#define SIPROUND(v0, v1, v2, v3) \
+	do { \
+		v0 += v1; v1 = (v1 << 13) | (v1 >> 51); v1 ^= v0; v0 = (v0 << 32) | (v0 >> 32); \
+		v2 += v3; v3 = (v3 << 16) | (v3 >> 48); v3 ^= v2; \
+		v0 += v3; v3 = (v3 << 21) | (v3 >> 43); v3 ^= v0; \
+		v2 += v1; v1 = (v1 << 17) | (v1 >> 47); v1 ^= v2; v2 = (v2 << 32) | (v2 >> 32); \
+	} while (0)
+
+unsigned long long Com_SipHash (const unsigned long long key [2], const qbyte* msg, size_t length)
+{
+	unsigned long long v0 = key[0] ^ 0x736f6d6570736575ULL;
+	unsigned long long v1 = key[1] ^ 0x646f72616e646f6dULL;
+	unsigned long long v2 = key[0] ^ 0x6c7967656e657261ULL;
+	unsigned long long v3 = key[1] ^ 0x7465646279746573ULL;
+	unsigned long long m;
+	size_t ind;
+
+	for (ind = 0; ind + 8 <= length; ind += 8)
+	{
+		unsigned int i;
+
+		m = 0;
+		for (i = 0; i < 8; i++)
+			m |= (unsigned long long)msg[ind + i] << (8 * i);
+
+		v3 ^= m;
+		SIPROUND (v0, v1, v2, v3);
+		SIPROUND (v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	// Last block: remaining bytes and message length
+	m = (unsigned long long)length << 56;
+	for (; ind < length; ind++)
+		m |= (unsigned long long)msg[ind] << (8 * (ind & 7));
+
+	v3 ^= m;
+	SIPROUND (v0, v1, v2, v3);
+	SIPROUND (v0, v1, v2, v3);
+	v0 ^= m;
+
+	v2 ^= 0xFF;
+	SIPROUND (v0, v1, v2, v3);
+	SIPROUND (v0, v1, v2, v3);
+	SIPROUND (v0, v1, v2, v3);
+	SIPROUND (v0, v1, v2, v3);
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
+
+
 /*
 ====================
 Com_SignalHandler
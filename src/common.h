@@ -27,6 +27,7 @@
 
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
 #include <signal.h>
@@ -44,6 +45,9 @@
 #define MAX_PACKET_SIZE_IN 2048
 #define MIN_PACKET_SIZE_IN 5
 
+// Maximum size of a reponse packet
+#define MAX_PACKET_SIZE_OUT 1400
+
 
 // ---------- Types ---------- //
 
@@ -51,6 +55,13 @@
 typedef enum {false, true} qboolean;
 typedef unsigned char qbyte;
 
+// Tell the CPU we'll soon read the memory at this address
+#ifdef __GNUC__
+#	define PREFETCH(ptr) __builtin_prefetch (ptr)
+#else
+#	define PREFETCH(ptr) ((void)0)
+#endif
+
 // The various messages levels
 typedef enum
 {
@@ -129,5 +140,8 @@ void Com_Printf (msg_level_t msg_level, const char* format, ...);
 // Handling of the signals sent to this process
 void Com_SignalHandler (int Signal);
 
+// Compute the SipHash-2-4 MAC of a message
+unsigned long long Com_SipHash (const unsigned long long key [2], const qbyte* msg, size_t length);
+
 
 #endif  // #ifndef _COMMON_H_
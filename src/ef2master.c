@@ -26,8 +26,9 @@
 #include "common.h"
 #include "system.h"
 #include "games.h"
-#include "messages.h"
 #include "servers.h"
+#include "messages.h"
+#include "outgoing.h"
 
 
 // ---------- Constants ---------- //
@@ -35,6 +36,20 @@
 // Version of ef2master
 #define VERSION "1.0"
 
+// Maximum number of packets read from a socket in one loop iteration
+#define RECV_BATCH_SIZE 64
+
+
+// ---------- Types ---------- //
+
+// Packet read from a socket, waiting for the rest of its batch to be read
+typedef struct
+{
+	size_t length;				// 0 if the packet has been rejected
+	socklen_t addrlen;
+	char data [MAX_PACKET_SIZE_IN + 1];  // "+ 1" because we append a '\0'
+} received_packet_t;
+
 
 // ---------- Private variables ---------- //
 
@@ -149,6 +164,16 @@ static const cmdlineopt_t cmdline_options [] =
 		1,
 		1
 	},
+	{
+		"pacing-rate",
+		"<packets>",
+		"Number of packets per second sent to a client for its server list\n"
+		"   (default: %d; 0 means as fast as possible)",
+		{ DEFAULT_PACING_RATE, 0 },
+		'\0',
+		1,
+		1
+	},
 	{
 		"port",
 		"<port_num>",
@@ -158,6 +183,27 @@ static const cmdlineopt_t cmdline_options [] =
 		1,
 		1
 	},
+	{
+		"retry-window",
+		"<seconds>",
+		"Ignore the getservers requests a client repeats within <seconds> seconds,\n"
+		"   or while they are still being answered (default: %d; 0 means retries\n"
+		"   are always answered)",
+		{ DEFAULT_GETSERVERS_RETRY_WINDOW, 0 },
+		'\0',
+		1,
+		1
+	},
+	{
+		"stateless-challenges",
+		NULL,
+		"Don't keep any state for servers which have only sent a heartbeat:\n"
+		"   their challenge is a MAC of their address and of the current time",
+		{ 0, 0 },
+		'\0',
+		0,
+		0
+	},
 	{
 		"verbose",
 		"[verbose_lvl]",
@@ -178,6 +224,15 @@ static const cmdlineopt_t cmdline_options [] =
 	}
 };
 
+// Number of outgoing packets dropped at the time of the last report
+static unsigned int last_nb_dropped = 0;
+
+// Current batch of received packets. The addresses of their senders are kept
+// apart, for looking them all up at once in the server list
+static received_packet_t recv_packets [RECV_BATCH_SIZE];
+static struct sockaddr_storage recv_addresses [RECV_BATCH_SIZE];
+static server_t* recv_servers [RECV_BATCH_SIZE];
+
 
 // ---------- Private functions ---------- //
 
@@ -233,6 +288,11 @@ static qboolean UnsecureInit (void)
 	if (! Sys_ResolveListenAddresses ())
 		return false;
 
+	// We may not be able to read the system random source after the chroot
+	Sv_InitPendingKey ();
+	if (stateless_challenges && ! InitChallengeKey ())
+		return false;
+
 	return true;
 }
 
@@ -383,6 +443,40 @@ static cmdline_status_t Cmdline_Option (const cmdlineopt_t* opt, const char** pa
 		master_port = port_num;
 	}
 
+	// Pacing rate of the getservers responses
+	else if (strcmp (opt_name, "pacing-rate") == 0)
+	{
+		const char* start_ptr;
+		char* end_ptr;
+		unsigned int rate;
+
+		start_ptr = params[0];
+		rate = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+		if (end_ptr == start_ptr || *end_ptr != '\0')
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+		pacing_rate = rate;
+	}
+
+	// getservers retry window
+	else if (strcmp (opt_name, "retry-window") == 0)
+	{
+		const char* start_ptr;
+		char* end_ptr;
+		unsigned int retry_window;
+
+		start_ptr = params[0];
+		retry_window = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+		if (end_ptr == start_ptr || *end_ptr != '\0')
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+		getservers_retry_window = retry_window;
+	}
+
+	// Stateless challenges
+	else if (strcmp (opt_name, "stateless-challenges") == 0)
+		stateless_challenges = true;
+
 	// Verbose level
 	else if (strcmp (opt_name, "verbose") == 0)
 	{
@@ -791,10 +885,178 @@ static qboolean SecureInit (void)
 	if (! Sv_Init ())
 		return false;
 
+	Out_Init ();
+
 	return true;
 }
 
 
+/*
+====================
+ReportOutboundQueues
+
+Print the state of the outbound queues if packets were dropped since the last report
+====================
+*/
+static void ReportOutboundQueues (void)
+{
+	const out_stats_t* stats = Out_GetStats ();
+
+	if (stats->nb_dropped != last_nb_dropped)
+	{
+		Com_Printf (MSG_WARNING,
+					"> WARNING: %u outgoing packets dropped (outbound queues full, %u packets waiting, %u at most)\n",
+					stats->nb_dropped - last_nb_dropped, stats->nb_queued, stats->max_queued);
+		last_nb_dropped = stats->nb_dropped;
+	}
+	else if (stats->nb_queued > 0)
+		Com_Printf (MSG_DEBUG, "> %u outgoing packets waiting (%u at most)\n",
+					stats->nb_queued, stats->max_queued);
+}
+
+
+/*
+====================
+SetPeerAddress
+
+Rebuild the peer address string, if we may print something
+====================
+*/
+static void SetPeerAddress (const struct sockaddr_storage* address, socklen_t addrlen)
+{
+	if (max_msg_level > MSG_NOPRINT &&
+		(Com_IsLogEnabled() || daemon_state < DAEMON_STATE_EFFECTIVE))
+	{
+		strncpy (peer_address, Sys_SockaddrToString(address, addrlen),
+				 sizeof (peer_address));
+		peer_address[sizeof (peer_address) - 1] = '\0';
+	}
+}
+
+
+/*
+====================
+ReadPacket
+
+Read one packet from a socket into a slot of the current batch, and check it.
+The slot length is set to 0 if the packet is rejected. Return false if there
+was nothing to read
+====================
+*/
+static qboolean ReadPacket (socket_t crt_sock, unsigned int slot)
+{
+	received_packet_t* rcv = &recv_packets[slot];
+	struct sockaddr_storage* address = &recv_addresses[slot];
+	char* packet = rcv->data;
+	int nb_bytes;
+
+	rcv->length = 0;
+
+	// Get the next valid message
+	rcv->addrlen = sizeof (*address);
+	nb_bytes = recvfrom (crt_sock, packet, sizeof (rcv->data) - 1, 0,
+						 (struct sockaddr*)address, &rcv->addrlen);
+
+	if (nb_bytes <= 0)
+	{
+		// Nothing left to read
+		if (Sys_GetLastNetError() == NETERR_WOULDBLOCK)
+			return false;
+
+		Com_Printf (MSG_WARNING,
+					"> WARNING: \"recvfrom\" returned %d\n", nb_bytes);
+		return true;
+	}
+
+	SetPeerAddress (address, rcv->addrlen);
+
+	// We print the packet contents if necessary
+	if (max_msg_level >= MSG_DEBUG)
+	{
+		Com_Printf (MSG_DEBUG, "> New packet received from %s: ",
+					peer_address);
+		PrintPacket ((qbyte*)packet, nb_bytes);
+	}
+
+	// A few sanity checks
+	if (address->ss_family != AF_INET && address->ss_family != AF_INET6)
+	{
+		Com_Printf (MSG_WARNING,
+					"> WARNING: rejected packet from %s (invalid address family: %hd)\n",
+					peer_address, address->ss_family);
+		return true;
+	}
+	if (Sys_GetSockaddrPort(address) == 0)
+	{
+		Com_Printf (MSG_WARNING,
+					"> WARNING: rejected packet from %s (source port = 0)\n",
+					peer_address);
+		return true;
+	}
+	if (nb_bytes < MIN_PACKET_SIZE_IN)
+	{
+		Com_Printf (MSG_WARNING,
+					"> WARNING: rejected packet from %s (size = %d bytes)\n",
+					peer_address, nb_bytes);
+		return true;
+	}
+	if (*((unsigned int*)packet) != 0xFFFFFFFF)
+	{
+		Com_Printf (MSG_WARNING,
+					"> WARNING: rejected packet from %s (invalid header)\n",
+					peer_address);
+		return true;
+	}
+
+	// Append a '\0' to make the parsing easier
+	packet[nb_bytes] = '\0';
+	rcv->length = (size_t)nb_bytes;
+	return true;
+}
+
+
+/*
+====================
+ReceivePackets
+
+Read a batch of packets from a socket, then handle them. The senders
+are looked up in the server list all at once, before the handling
+====================
+*/
+static void ReceivePackets (socket_t crt_sock)
+{
+	unsigned int nb_reads;
+	unsigned int nb_packets = 0;
+	unsigned int ind;
+
+	for (nb_reads = 0; nb_reads < RECV_BATCH_SIZE; nb_reads++)
+	{
+		if (! ReadPacket (crt_sock, nb_packets))
+			break;
+
+		// Rejected packets leave their slot to the next one
+		if (recv_packets[nb_packets].length > 0)
+			nb_packets++;
+	}
+
+	if (nb_packets == 0)
+		return;
+
+	Sv_GetByAddrBatch (recv_addresses, nb_packets, recv_servers);
+
+	for (ind = 0; ind < nb_packets; ind++)
+	{
+		received_packet_t* rcv = &recv_packets[ind];
+
+		SetPeerAddress (&recv_addresses[ind], rcv->addrlen);
+
+		// Call HandleMessage with the contents after the header
+		HandleMessage (rcv->data + 4, rcv->length - 4, &recv_addresses[ind],
+					   rcv->addrlen, crt_sock, recv_servers[ind]);
+	}
+}
+
+
 /*
 ====================
 main
@@ -805,6 +1067,7 @@ Main function
 int main (int argc, const char* argv [])
 {
 	cmdline_status_t valid_options;
+	time_t last_timeout_check;
 
 	// Get the options from the command line
 	valid_options = ParseCommandLine (argc, argv);
@@ -831,6 +1094,7 @@ int main (int argc, const char* argv [])
 		! Sys_SecurityInit () ||
 		! Sys_SecureInit () || ! SecureInit ())
 		return EXIT_FAILURE;
+	last_timeout_check = crt_time;
 
 	// Until the end of times...
 	for (;;)
@@ -839,14 +1103,20 @@ int main (int argc, const char* argv [])
 		socket_t max_sock;
 		size_t sock_ind;
 		int nb_sock_ready;
+		struct timeval timeout;
+		struct timeval* timeout_ptr = NULL;
+		fd_set write_set;
 
 		FD_ZERO(&sock_set);
+		FD_ZERO(&write_set);
 		max_sock = INVALID_SOCKET;
 		for (sock_ind = 0; sock_ind < nb_sockets; sock_ind++)
 		{
 			socket_t crt_sock = listen_sockets[sock_ind].socket;
 
 			FD_SET(crt_sock, &sock_set);
+			if (Out_HasQueuedPackets (crt_sock))
+				FD_SET(crt_sock, &write_set);
 			if (max_sock == INVALID_SOCKET || max_sock < crt_sock)
 				max_sock = crt_sock;
 		}
@@ -857,18 +1127,37 @@ int main (int argc, const char* argv [])
 		if (daemon_state < DAEMON_STATE_EFFECTIVE)
 			fflush (stdout);
 
-		nb_sock_ready = select ((int)(max_sock + 1), &sock_set, NULL, NULL, NULL);
+		// Don't wait for new packets longer than the responses in progress can
+		if (HasResponseJobs ())
+		{
+			unsigned int delay = GetResponseJobsDelay ();
+
+			timeout.tv_sec = delay / 1000;
+			timeout.tv_usec = (delay % 1000) * 1000;
+			timeout_ptr = &timeout;
+		}
+		nb_sock_ready = select ((int)(max_sock + 1), &sock_set, &write_set, NULL, timeout_ptr);
 
 		// Update the current time
 		crt_time = time (NULL);
 
+		// Remove the servers that have timed out, at most once per second.
+		// Queries only read the server list, so this is the only place
+		// (with the registration of new servers) where servers expire
+		if (crt_time != last_timeout_check)
+		{
+			Sv_CheckTimeouts ();
+			ReportOutboundQueues ();
+			last_timeout_check = crt_time;
+		}
+
 		print_date = false;
 		Com_UpdateLogStatus (false);
 
 		// Print the date once per select()
 		print_date = true;
 
-		if (nb_sock_ready <= 0)
+		if (nb_sock_ready < 0)
 		{
 			if (Sys_GetLastNetError() != NETERR_INTR)
 				Com_Printf (MSG_WARNING,
@@ -881,80 +1170,26 @@ int main (int argc, const char* argv [])
 			 sock_ind < nb_sockets && nb_sock_ready > 0;
 			 sock_ind++)
 		{
-			struct sockaddr_storage address;
-			socklen_t addrlen;
-			int nb_bytes;
-			char packet [MAX_PACKET_SIZE_IN + 1];  // "+ 1" because we append a '\0'
 			socket_t crt_sock = listen_sockets[sock_ind].socket;
 
-			if (! FD_ISSET (crt_sock, &sock_set))
-				continue;
-			nb_sock_ready--;
-
-			// Get the next valid message
-			addrlen = sizeof (address);
-			nb_bytes = recvfrom (crt_sock, packet, sizeof (packet) - 1, 0,
-								 (struct sockaddr*)&address, &addrlen);
-
-			if (nb_bytes <= 0)
-			{
-				Com_Printf (MSG_WARNING,
-							"> WARNING: \"recvfrom\" returned %d\n", nb_bytes);
-				continue;
-			}
-
-			// If we may print something, rebuild the peer address string
-			if (max_msg_level > MSG_NOPRINT &&
-				(Com_IsLogEnabled() || daemon_state < DAEMON_STATE_EFFECTIVE))
-			{
-				strncpy (peer_address, Sys_SockaddrToString(&address, addrlen),
-						 sizeof (peer_address));
-				peer_address[sizeof (peer_address) - 1] = '\0';
-			}
-
-			// We print the packet contents if necessary
-			if (max_msg_level >= MSG_DEBUG)
+			// Send the packets which were waiting for the socket to be writable
+			if (FD_ISSET (crt_sock, &write_set))
 			{
-				Com_Printf (MSG_DEBUG, "> New packet received from %s: ",
-							peer_address);
-				PrintPacket ((qbyte*)packet, nb_bytes);
+				nb_sock_ready--;
+				Out_Flush (crt_sock);
 			}
 
-			// A few sanity checks
-			if (address.ss_family != AF_INET && address.ss_family != AF_INET6)
-			{
-				Com_Printf (MSG_WARNING,
-							"> WARNING: rejected packet from %s (invalid address family: %hd)\n",
-							peer_address, address.ss_family);
-				continue;
-			}
-			if (Sys_GetSockaddrPort(&address) == 0)
-			{
-				Com_Printf (MSG_WARNING,
-							"> WARNING: rejected packet from %s (source port = 0)\n",
-							peer_address);
-				continue;
-			}
-			if (nb_bytes < MIN_PACKET_SIZE_IN)
-			{
-				Com_Printf (MSG_WARNING,
-							"> WARNING: rejected packet from %s (size = %d bytes)\n",
-							peer_address, nb_bytes);
-				continue;
-			}
-			if (*((unsigned int*)packet) != 0xFFFFFFFF)
-			{
-				Com_Printf (MSG_WARNING,
-							"> WARNING: rejected packet from %s (invalid header)\n",
-							peer_address);
+			if (! FD_ISSET (crt_sock, &sock_set))
 				continue;
-			}
-
-			// Append a '\0' to make the parsing easier
-			packet[nb_bytes] = '\0';
+			nb_sock_ready--;
 
-			// Call HandleMessage with the remaining contents
-			HandleMessage (packet + 4, nb_bytes - 4, &address, addrlen, crt_sock);
+			ReceivePackets (crt_sock);
 		}
+
+		// Answer the client requests of this batch, then move on with
+		// the responses still in progress, and send all that at once
+		HandleQueuedQueries ();
+		AdvanceResponseJobs ();
+		Out_FlushBatch ();
 	}
 }
@@ -25,8 +25,9 @@
 #include "common.h"
 #include "system.h"
 #include "games.h"
-#include "messages.h"
 #include "servers.h"
+#include "messages.h"
+#include "outgoing.h"
 
 
 // ---------- Constants ---------- //
@@ -37,12 +38,12 @@
 // Period of validity for a challenge string (in secondes)
 #define TIMEOUT_CHALLENGE 2
 
+// Number of characters in a stateless challenge (6 bits of MAC per character)
+#define STATELESS_CHALLENGE_LENGTH 10
+
 // Gamename used for Q3A
 #define GAMENAME_EF2 "STEF2"
 
-// Maximum size of a reponse packet
-#define MAX_PACKET_SIZE_OUT 1400
-
 
 // Types of messages (with samples):
 
@@ -50,6 +51,9 @@
 // DP: "heartbeat DarkPlaces\x0A"
 #define S2M_HEARTBEAT "heartbeat"
 
+// EF2: "heartbeat TikiServer-Flatline\x0A", when a server shuts down
+#define S2M_FLATLINE_GAMEID "TikiServer-Flatline"
+
 // Q3 & DP & QFusion: "getinfo A_Challenge"
 #define M2S_GETINFO "getinfo"
 
@@ -62,6 +66,9 @@
 // QFusion: "getservers qfusion 39 empty full"
 #define C2M_GETSERVERS "getservers "
 
+// ef2master: "getserversCount" or "getserversCount STEF2"
+#define C2M_GETSERVERSCOUNT "getserversCount"
+
 // DP: "getserversExt DarkPlaces-Quake 3 empty full ipv4 ipv6"
 // IOQuake3: "getserversExt 68 empty ipv6"
 #define C2M_GETSERVERSEXT "getserversExt "
@@ -74,100 +81,381 @@
 // "getserversExtResponse\\...(6 bytes)...//...(18 bytes)...\\EOT\0\0\0"
 #define M2C_GETSERVERSEXTREPONSE "getserversExtResponse"
 
+// ef2master, answer to "getserversExt ... delta[=<generation>]":
+// "getserversDeltaResponse <generation> full|delta\x0A\\...(12 bytes)...-\\...(12 bytes)...\\EOT\0\0\0"
+#define M2C_GETSERVERSDELTAREPONSE "getserversDeltaResponse"
+
+// ef2master, answer to "getserversCount", one line per game name and protocol:
+// "getserversCountResponse\x0ASTEF2 66 <empty> <occupied> <full>\x0A..."
+#define M2C_GETSERVERSCOUNTREPONSE "getserversCountResponse"
+
+// ef2master, answer to "getserversExt ... info":
+// "getserversInfoResponse\\...(12 bytes)...\\key\\value...\0\\...(12 bytes)...\\key\\value...\0\\EOT\0\0\0"
+#define M2C_GETSERVERSINFOREPONSE "getserversInfoResponse"
+
+// ef2master, answer to "getserversExt ... page[=<generation>:<cursor>]":
+// "getserversPageResponse <generation>:<cursor>|end\x0A\\...(12 bytes)...\\EOT\0\0\0"
+#define M2C_GETSERVERSPAGEREPONSE "getserversPageResponse"
+
+// Maximum size of a server entry in a getservers response (record + infostring + '\0')
+#define MAX_ENTRY_SIZE (MAX_RECORD_SIZE + MAX_INFOSTRING_LENGTH + 1)
+
+// Maximum number of changes we're willing to go through for a delta getservers
+#define CHANGE_LOG_MAX_DELTA 4096
+
+// Number of prerendered getservers responses we keep
+#define RESPONSE_CACHE_SIZE 16
+
+// Maximum number of getservers requests waiting for the end of the current batch of packets
+#define MAX_QUEUED_QUERIES 64
+
+// Maximum number of getservers responses being built or sent at the same time
+#define MAX_RESPONSE_JOBS 64
+
+// Number of packets a response job builds or sends each time it's advanced.
+// It's also the number of packets a paced job can send in a row
+#define JOB_PACKETS_PER_SLICE 4
+
+// Maximum number of slots browsed for a page of a paged getservers response
+// (the page may be incomplete, or even empty, when few servers match)
+#define PAGE_MAX_SCANNED_SLOTS 1024
+
+// Size of the table of recent getservers requests, used for spotting retries
+#define RECENT_QUERIES_NB_BUCKETS 256
+#define RECENT_QUERIES_BUCKET_SIZE 4
+
+// Maximum length of an infostring value we're willing to use
+#define MAX_INFO_VALUE_LENGTH 255
+
+// Maximum number of parts of an infostring copied for the clients
+// (one more than the number of "challenge" keys it contains, usually 2)
+#define MAX_INFO_SPANS 8
+
+
+
+// ---------- Types ---------- //
+
+// Filters of a getservers or getserversExt request. Always cleared before being
+// filled, so that 2 requests with the same filters can be compared with memcmp
+typedef struct
+{
+	char gamename [GAMENAME_LENGTH];
+	int protocol;
+	char gametype [GAMETYPE_LENGTH];	// only relevant if "opt_gametype" is set
+	qboolean opt_gametype;
+	qboolean opt_empty;
+	qboolean opt_full;
+	qboolean opt_ipv4;
+	qboolean opt_ipv6;
+	qboolean opt_binary;		// IPv4 addresses in binary, as in Q3 (4 + 2 bytes)
+	qboolean opt_info;			// each address is followed by the server infostring
+	qboolean extended;
+	qboolean delta_list;		// complete list with a "getserversDeltaResponse <generation> full" header
+
+	// Filters on the infostrings (names are in lowercase)
+	qboolean opt_map;
+	char mapname [MAPNAME_LENGTH];
+	unsigned int min_players;
+	qboolean opt_hostname;
+	char hostname [HOSTNAME_LENGTH];	// any host name containing this string matches
+} getservers_filter_t;
+
+// Parameters of a getservers or getserversExt request
+typedef struct
+{
+	const char* request_name;
+	getservers_filter_t filter;
+	qboolean opt_delta;			// the client wants the generation of the list...
+	qboolean has_delta_base;	// ... and maybe only the changes since "delta_base"
+	unsigned int delta_base;
+	qboolean opt_page;			// the client wants the list one packet at a time...
+	qboolean has_page_token;	// ... and maybe the page starting at "page_cursor"
+	unsigned int page_generation;
+	unsigned int page_cursor;
+} getservers_query_t;
+
+// getservers request waiting to be answered
+typedef struct
+{
+	getservers_query_t query;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	socket_t sock;
+	char peer_address [128];
+} queued_query_t;
+
+// Recent getservers request
+typedef struct
+{
+	sv_address_t addr;
+	socklen_t addrlen;			// 0 if the entry is free
+	unsigned int query_hash;
+	time_t time;				// when we last answered it
+} recent_query_t;
+
+// Packet of a prerendered getservers response
+typedef struct
+{
+	size_t size;
+	unsigned int nb_servers;
+	qbyte data [MAX_PACKET_SIZE_OUT];
+} cached_packet_t;
+
+// Response to a client request, sent packet by packet
+typedef struct
+{
+	struct cached_response_s* cache;	// if not NULL, packets are stored there instead of being sent
+	qbyte packet [MAX_PACKET_SIZE_OUT];
+	size_t headersize;
+	size_t packetind;
+	unsigned int nb_servers;
+	const char* request_name;
+	const struct sockaddr_storage* addr;
+	socklen_t addrlen;
+	socket_t sock;
+} response_t;
+
+// Prerendered getservers response, valid as long as the server list doesn't change
+typedef struct cached_response_s
+{
+	qboolean in_use;
+	qboolean building;			// packets are still being added by "builder"
+	unsigned int nb_users;		// response jobs using it (it can't be recycled meanwhile)
+	getservers_filter_t filter;
+	unsigned int generation;	// generation of the server list it was built from
+	unsigned int info_generation;	// only relevant if "filter.opt_info" is set
+	unsigned int last_use;		// for recycling the least recently used entry
+	unsigned int nb_packets;
+	unsigned int max_packets;
+	cached_packet_t* packets;
+
+	// Prerendering in progress
+	response_t builder;
+	sv_iterator_t sv_iter;
+	qboolean walk_started;
+} cached_response_t;
+
+// getservers response being built and sent a few packets at a time
+typedef struct
+{
+	qboolean in_use;
+	queued_query_t request;
+	cached_response_t* entry;
+	unsigned int first_packet;	// packets are sent starting from a random one
+	unsigned int nb_sent;
+
+	// Pacing (token bucket)
+	unsigned int nb_tokens;		// number of packets it can send right now
+	unsigned int token_time;	// when the last token was added, in milliseconds
+} response_job_t;
+
+// Infostring keys used by the master
+typedef enum
+{
+	INFO_KEY_CHALLENGE,
+	INFO_KEY_PROTOCOL,
+	INFO_KEY_GAMETYPE,
+	INFO_KEY_MAXCLIENTS,
+	INFO_KEY_CLIENTS,
+	INFO_KEY_GAMENAME,
+	INFO_KEY_MAPNAME,
+	INFO_KEY_HOSTNAME,
+
+	INFO_NB_KEYS
+} info_key_t;
+
+// Part of an infostring (not '\0'-terminated)
+typedef struct
+{
+	const char* start;			// NULL if there's no such part
+	size_t length;
+} info_slice_t;
+
+// Infostring split into slices in a single pass. The slices point into the infostring itself
+typedef struct
+{
+	qboolean is_valid;					// false if the infostring is malformed
+	info_slice_t values [INFO_NB_KEYS];	// value of the first occurrence of each key
+
+	// Parts of the infostring given to the clients (all but the "challenge" key)
+	info_slice_t spans [MAX_INFO_SPANS];
+	unsigned int nb_spans;
+	size_t spans_length;
+	qboolean too_many_spans;
+} infostring_t;
+
+
+
+// ---------- Private variables ---------- //
+
+// Secret key of the stateless challenges
+static unsigned long long challenge_key [2];
+
+// Characters used for encoding the stateless challenges, all valid in a challenge
+static const char challenge_charset [64] =
+	"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz+-";
+
+// End Of Transmission mark, at the end of the last packet of a getservers response
+static const qbyte eot_mark [] = { '\\', 'E', 'O', 'T', '\0', '\0', '\0' };
+
+// Prerendered getservers responses
+static cached_response_t response_cache [RESPONSE_CACHE_SIZE];
+static unsigned int response_cache_clock = 0;
+
+// getservers requests received in the current batch of packets
+static queued_query_t queued_queries [MAX_QUEUED_QUERIES];
+static unsigned int nb_queued_queries = 0;
+
+// getservers responses being built or sent
+static response_job_t response_jobs [MAX_RESPONSE_JOBS];
+static unsigned int nb_response_jobs = 0;
+
+// Incremented each time the infostring of a server changes
+static unsigned int info_generation = 0;
+
+// getservers requests answered recently
+static recent_query_t recent_queries [RECENT_QUERIES_NB_BUCKETS][RECENT_QUERIES_BUCKET_SIZE];
+
+// Names of the infostring keys used by the master (see info_key_t)
+static const char* const info_key_names [INFO_NB_KEYS] =
+{
+	"challenge",
+	"protocol",
+	"gametype",
+	"sv_maxclients",
+	"clients",
+	"gamename",
+	"mapname",
+	"hostname",
+};
+
+
+// ---------- Public variables ---------- //
+
+// Do we use stateless challenges for the servers which aren't registered yet?
+qboolean stateless_challenges = false;
+
+// getservers requests repeated by a client within this number of seconds are ignored
+unsigned int getservers_retry_window = DEFAULT_GETSERVERS_RETRY_WINDOW;
+
+// Packets per second sent to each client for its getservers response (0 means no limit)
+unsigned int pacing_rate = DEFAULT_PACING_RATE;
 
 
 // ---------- Private functions ---------- //
 
 /*
 ====================
-SearchInfostring
+FindInfoKey
 
-Search an infostring for the value of a key
+Get the index of an infostring key used by the master, or INFO_NB_KEYS if we don't use it
 ====================
 */
-static const char* SearchInfostring (const char* infostring, const char* key)
+static info_key_t FindInfoKey (const char* key, size_t key_length)
 {
-	static char str_buffer [256];
-	size_t buffer_ind;
-	char c;
+	unsigned int ind;
 
-	if (*infostring++ != '\\')
-		return NULL;
-
-	for (;;)
+	for (ind = 0; ind < INFO_NB_KEYS; ind++)
 	{
-		buffer_ind = 0;
+		const char* name = info_key_names[ind];
 
-		// Get the key name
-		for (;;)
-		{
-			c = *infostring++;
+		if (strncmp (key, name, key_length) == 0 && name[key_length] == '\0')
+			return (info_key_t)ind;
+	}
 
-			if (c == '\\')
-			{
-				str_buffer[buffer_ind] = '\0';
-				break;
-			}
+	return INFO_NB_KEYS;
+}
 
-			// If it's the end of the infostring
-			if (c == '\0')
-				return NULL;
 
-			// If the key name is too long, skip this key/value pair
-			if (buffer_ind == sizeof (str_buffer) - 1)
-			{
-				// Skip the rest of the key name
-				for (;;)
-				{
-					c = *infostring++;
+/*
+====================
+ParseInfostring
 
-					if (c == '\0')
-						return NULL;
-					if (c == '\\')
-						break;
-				}
+Split an infostring into key/value slices, in a single pass. The slices
+point into the infostring, so it must outlive the parsed infostring
+====================
+*/
+static void ParseInfostring (const char* infostring, infostring_t* info)
+{
+	const char* crt = infostring;
 
-				str_buffer[0] = '\0';
-				break;
-			}
+	memset (info, 0, sizeof (*info));
+
+	if (*crt != '\\')
+		return;
 
-			str_buffer[buffer_ind++] = c;
+	while (*crt != '\0')
+	{
+		const char* key = crt + 1;
+		const char* value;
+		const char* end;
+		info_key_t key_ind;
+
+		// A key without value ends the infostring
+		for (value = key; *value != '\\'; value++)
+			if (*value == '\0')
+				return;
+		value++;
+		for (end = value; *end != '\\' && *end != '\0'; end++)
+			;
+
+		key_ind = FindInfoKey (key, value - 1 - key);
+		if (key_ind < INFO_NB_KEYS && info->values[key_ind].start == NULL)
+		{
+			info->values[key_ind].start = value;
+			info->values[key_ind].length = end - value;
 		}
 
-		// If it's the key we are looking for, save it in "value"
-		if (!strcmp (str_buffer, key))
+		// Keep the pair for the clients, merged with the previous one if they're contiguous
+		if (key_ind != INFO_KEY_CHALLENGE)
 		{
-			buffer_ind = 0;
+			info_slice_t* span = NULL;
 
-			for (;;)
+			if (info->nb_spans > 0)
+			{
+				span = &info->spans[info->nb_spans - 1];
+				if (span->start + span->length != crt)
+					span = NULL;
+			}
+			if (span == NULL && info->nb_spans < MAX_INFO_SPANS)
 			{
-				c = *infostring++;
+				span = &info->spans[info->nb_spans++];
+				span->start = crt;
+				span->length = 0;
+			}
 
-				if (c == '\0' || c == '\\')
-				{
-					str_buffer[buffer_ind] = '\0';
-					return str_buffer;
-				}
+			if (span != NULL)
+				span->length += end - crt;
+			else
+				info->too_many_spans = true;
+			info->spans_length += end - crt;
+		}
 
-				// If the value name is too long, ignore it
-				if (buffer_ind == sizeof (str_buffer) - 1)
-					return NULL;
+		crt = end;
+	}
 
-				str_buffer[buffer_ind++] = c;
-			}
-		}
+	info->is_valid = true;
+}
 
-		// Else, skip the value
-		for (;;)
-		{
-			c = *infostring++;
 
-			if (c == '\0')
-				return NULL;
-			if (c == '\\')
-				break;
-		}
-	}
+/*
+====================
+GetInfoValue
+
+Get the value of a key in a parsed infostring, copied in "buffer".
+Return NULL if the key is absent, or if its value doesn't fit
+====================
+*/
+static const char* GetInfoValue (const infostring_t* info, info_key_t key, char* buffer, size_t buffer_size)
+{
+	const info_slice_t* value = &info->values[key];
+
+	if (value->start == NULL || value->length >= buffer_size || value->length > MAX_INFO_VALUE_LENGTH)
+		return NULL;
+
+	memcpy (buffer, value->start, value->length);
+	buffer[value->length] = '\0';
+	return buffer;
 }
 
 
@@ -205,82 +493,166 @@ static const char* BuildChallenge (void)
 
 /*
 ====================
-SendGetInfo
+BuildStatelessChallenge
 
-Send a "getinfo" message to a server
+Build the stateless challenge of an address for a given time period. It's a MAC
+of the address, port and period, so we can check it without storing anything
 ====================
 */
-static void SendGetInfo (server_t* server, socket_t recv_socket)
+static const char* BuildStatelessChallenge (const struct sockaddr_storage* address, unsigned int period)
 {
-	char msg [64] = "\xFF\xFF\xFF\xFF" M2S_GETINFO " ";
-	size_t msglen;
+	static char challenge [STATELESS_CHALLENGE_LENGTH + 1];
+	qbyte msg [1 + 16 + 2 + 4];
+	size_t msglen = 0;
+	unsigned long long mac;
+	size_t ind;
+
+	if (address->ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)address;
+
+		msg[msglen++] = 6;
+		memcpy (&msg[msglen], &addr6->sin6_addr.s6_addr, 16);
+		msglen += 16;
+		memcpy (&msg[msglen], &addr6->sin6_port, 2);
+		msglen += 2;
+	}
+	else
+	{
+		const struct sockaddr_in* addr4 = (const struct sockaddr_in*)address;
+
+		assert (address->ss_family == AF_INET);
+		msg[msglen++] = 4;
+		memcpy (&msg[msglen], &addr4->sin_addr.s_addr, 4);
+		msglen += 4;
+		memcpy (&msg[msglen], &addr4->sin_port, 2);
+		msglen += 2;
+	}
+	msg[msglen++] = (qbyte)(period >> 24);
+	msg[msglen++] = (qbyte)(period >> 16);
+	msg[msglen++] = (qbyte)(period >> 8);
+	msg[msglen++] = (qbyte)period;
 
-	if (!server->challenge_timeout || server->challenge_timeout < crt_time)
+	mac = Com_SipHash (challenge_key, msg, msglen);
+	for (ind = 0; ind < STATELESS_CHALLENGE_LENGTH; ind++)
 	{
-		const char* challenge;
+		challenge[ind] = challenge_charset[mac & 63];
+		mac >>= 6;
+	}
+	challenge[STATELESS_CHALLENGE_LENGTH] = '\0';
+
+	assert (STATELESS_CHALLENGE_LENGTH + 1 >= CHALLENGE_MIN_LENGTH);
+	assert (STATELESS_CHALLENGE_LENGTH + 1 <= CHALLENGE_MAX_LENGTH);
+	return challenge;
+}
+
+
+/*
+====================
+IsValidStatelessChallenge
+
+Check a stateless challenge by computing it again, for the current and the previous time periods
+====================
+*/
+static qboolean IsValidStatelessChallenge (const struct sockaddr_storage* address, const char* challenge)
+{
+	unsigned int period = (unsigned int)(crt_time / TIMEOUT_CHALLENGE);
+
+	return (strcmp (challenge, BuildStatelessChallenge (address, period)) == 0 ||
+			strcmp (challenge, BuildStatelessChallenge (address, period - 1)) == 0);
+}
 
-		challenge = BuildChallenge ();
-		strncpy (server->challenge, challenge, sizeof (server->challenge) - 1);
-		server->challenge_timeout = crt_time + TIMEOUT_CHALLENGE;
+
+/*
+====================
+RenewChallenge
+
+Build a new challenge if the current one is obsolete
+====================
+*/
+static void RenewChallenge (char* challenge, time_t* challenge_timeout)
+{
+	if (!*challenge_timeout || *challenge_timeout < crt_time)
+	{
+		strncpy (challenge, BuildChallenge (), CHALLENGE_MAX_LENGTH - 1);
+		challenge[CHALLENGE_MAX_LENGTH - 1] = '\0';
+		*challenge_timeout = crt_time + TIMEOUT_CHALLENGE;
 	}
+}
+
+
+/*
+====================
+SendGetInfo
+
+Send a "getinfo" message to a server
+====================
+*/
+static void SendGetInfo (const char* challenge,
+						 const struct sockaddr_storage* address, socklen_t addrlen,
+						 socket_t recv_socket)
+{
+	char msg [64] = "\xFF\xFF\xFF\xFF" M2S_GETINFO " ";
+	size_t msglen;
 
 	msglen = strlen (msg);
-	strncpy (msg + msglen, server->challenge, sizeof (msg) - msglen - 1);
+	strncpy (msg + msglen, challenge, sizeof (msg) - msglen - 1);
 	msg[sizeof (msg) - 1] = '\0';
-	if (sendto (recv_socket, msg, strlen (msg), 0,
-				(const struct sockaddr*)&server->address,
-				server->addrlen) < 0)
-		Com_Printf (MSG_WARNING, "> WARNING: can't send getinfo (%s)\n",
-					Sys_GetLastNetErrorString ());
+	if (! Out_SendTo (recv_socket, msg, strlen (msg), address, addrlen))
+		Com_Printf (MSG_WARNING, "> WARNING: can't send getinfo (outbound queue full)\n");
 	else
 		Com_Printf (MSG_NORMAL, "> %s <--- getinfo with challenge \"%s\"\n",
-					peer_address, server->challenge);
+					peer_address, challenge);
 }
 
 /*
 ====================
-HandleGetServers
+CopyLowercase
 
-Parse getservers requests and send the appropriate response
+Copy a string in lowercase, truncating it if necessary
 ====================
 */
-static void HandleGetServers (const char* msg, const struct sockaddr_storage* addr, socklen_t addrlen, socket_t recv_socket, qboolean extended_request)
+static void CopyLowercase (char* dest, const char* src, size_t dest_size)
+{
+	size_t ind;
+
+	for (ind = 0; ind + 1 < dest_size && src[ind] != '\0'; ind++)
+		dest[ind] = (char)tolower ((qbyte)src[ind]);
+	dest[ind] = '\0';
+}
+
+
+/*
+====================
+ParseGetServers
+
+Parse the parameters of a getservers or getserversExt request
+====================
+*/
+static qboolean ParseGetServers (const char* msg, qboolean extended_request, getservers_query_t* query)
 {
-	const char* packetheader;
-	size_t headersize;
 	char* end_ptr;
 	const char* msg_ptr;
-	char gamename [GAMENAME_LENGTH] = "";
-	qbyte packet [MAX_PACKET_SIZE_OUT];
-	size_t packetind;
-	server_t* sv;
-	int protocol;
-	char gametype [GAMETYPE_LENGTH] = "0";
 	qboolean use_dp_protocol;
-	qboolean opt_empty = false;
-	qboolean opt_full = false;
-	qboolean opt_ipv4 = (! extended_request);
-	qboolean opt_ipv6 = false;
-	qboolean opt_gametype = false;
 	char filter_options [MAX_PACKET_SIZE_IN];
 	char* option_ptr;
-	unsigned int nb_servers;
-	const char* request_name;
-	char buffer[8];
-	int port1, port2;
+
+	memset (query, 0, sizeof (*query));
+	query->filter.extended = extended_request;
+	query->filter.opt_ipv4 = (! extended_request);
 
 	if (extended_request)
 	{
-		request_name = "getserversExt";
+		query->request_name = "getserversExt";
 		use_dp_protocol = true;
 	}
 	else
 	{
-		request_name = "getservers";
+		query->request_name = "getservers";
 
 		// Check if there's a name before the protocol number
 		// In this case, the message comes from a DarkPlaces-compatible client
-		protocol = (int)strtol (msg, &end_ptr, 0);
+		query->filter.protocol = (int)strtol (msg, &end_ptr, 0);
 		use_dp_protocol = (end_ptr == msg || (*end_ptr != ' ' && *end_ptr != '\0'));
 	}
 
@@ -297,45 +669,48 @@ static void HandleGetServers (const char* msg, const struct sockaddr_storage* ad
 		{
 			Com_Printf (MSG_WARNING,
 						"> WARNING: Rejecting %s from %s (missing game name and protocol number)\n",
-						request_name, peer_address);
-			return;
+						query->request_name, peer_address);
+			return false;
 		}
 
 		// Read the game name
-		strncpy (gamename, msg_ptr, sizeof (gamename) - 1);
-		gamename[sizeof (gamename) - 1] = '\0';
-		space = strchr (gamename, ' ');
+		strncpy (query->filter.gamename, msg_ptr, sizeof (query->filter.gamename) - 1);
+		query->filter.gamename[sizeof (query->filter.gamename) - 1] = '\0';
+		space = strchr (query->filter.gamename, ' ');
 		if (space)
-			*space = '\0';
-		msg_ptr = msg_ptr + strlen (gamename);
+		{
+			// Clear the rest of the request too, the filters are compared with memcmp
+			memset (space, 0, &query->filter.gamename[sizeof (query->filter.gamename)] - space);
+		}
+		msg_ptr = msg_ptr + strlen (query->filter.gamename);
 
 		// Read the protocol number
-		protocol = (int)strtol (msg_ptr, &end_ptr, 0);
+		query->filter.protocol = (int)strtol (msg_ptr, &end_ptr, 0);
 		if (end_ptr == msg_ptr || (*end_ptr != ' ' && *end_ptr != '\0'))
 		{
 			Com_Printf (MSG_WARNING,
 						"> WARNING: Rejecting %s from %s (missing or invalid protocol number)\n",
-						request_name, peer_address);
-			return;
+						query->request_name, peer_address);
+			return false;
 		}
 	}
 	// Else, it comes from a Quake III Arena client
 	else
 	{
-		strncpy (gamename, GAMENAME_EF2, sizeof (gamename) - 1);
-		gamename[sizeof (gamename) - 1] = '\0';
-		msg_ptr = end_ptr;
+		strncpy (query->filter.gamename, GAMENAME_EF2, sizeof (query->filter.gamename) - 1);
+		query->filter.gamename[sizeof (query->filter.gamename) - 1] = '\0';
 	}
+	msg_ptr = end_ptr;
 
-	Com_Printf (MSG_NORMAL, "> %s ---> %s (%s)\n", peer_address, request_name,
-				gamename);
+	Com_Printf (MSG_NORMAL, "> %s ---> %s (%s)\n", peer_address,
+				query->request_name, query->filter.gamename);
 
-	if (! Game_IsAccepted (gamename))
+	if (! Game_IsAccepted (query->filter.gamename))
 	{
 		Com_Printf (MSG_WARNING,
 					"> WARNING: Rejecting %s from %s (game \"%s\" is not accepted)\n",
-					request_name, peer_address, gamename);
-		return;
+					query->request_name, peer_address, query->filter.gamename);
+		return false;
 	}
 
 	// Parse the filtering options
@@ -345,305 +720,1455 @@ static void HandleGetServers (const char* msg, const struct sockaddr_storage* ad
 	while (option_ptr != NULL)
 	{
 		if (strcmp (option_ptr, "empty") == 0)
-			opt_empty = true;
+			query->filter.opt_empty = true;
 		else if (strcmp (option_ptr, "full") == 0)
-			opt_full = true;
+			query->filter.opt_full = true;
 		else if (strcmp (option_ptr, "ffa") == 0)
 		{
-			gametype[0] = '0';
-			gametype[1] = '\0';
-			opt_gametype = true;
+			strncpy (query->filter.gametype, "0", sizeof (query->filter.gametype) - 1);
+			query->filter.opt_gametype = true;
 		}
 		else if (strcmp (option_ptr, "tourney") == 0)
 		{
-			gametype[0] = '1';
-			gametype[1] = '\0';
-			opt_gametype = true;
+			strncpy (query->filter.gametype, "1", sizeof (query->filter.gametype) - 1);
+			query->filter.opt_gametype = true;
 		}
 		else if (strcmp (option_ptr, "team") == 0)
 		{
-			gametype[0] = '3';
-			gametype[1] = '\0';
-			opt_gametype = true;
+			strncpy (query->filter.gametype, "3", sizeof (query->filter.gametype) - 1);
+			query->filter.opt_gametype = true;
 		}
 		else if (strcmp (option_ptr, "ctf") == 0)
 		{
-			gametype[0] = '4';
-			gametype[1] = '\0';
-			opt_gametype = true;
+			strncpy (query->filter.gametype, "4", sizeof (query->filter.gametype) - 1);
+			query->filter.opt_gametype = true;
 		}
 		else if (strncmp (option_ptr, "gametype=", 9) == 0)
 		{
 			const char* gametype_string = option_ptr + 9;
 
-			strncpy(gametype, gametype_string, sizeof(gametype) - 1);
-			gametype[sizeof(gametype) - 1] = '\0';
-			opt_gametype = true;
+			memset (query->filter.gametype, 0, sizeof (query->filter.gametype));
+			strncpy (query->filter.gametype, gametype_string, sizeof (query->filter.gametype) - 1);
+			query->filter.opt_gametype = true;
 		}
 		else if (extended_request)
 		{
 			if (strcmp (option_ptr, "ipv4") == 0)
-				opt_ipv4 = true;
+				query->filter.opt_ipv4 = true;
 			else if (strcmp (option_ptr, "ipv6") == 0)
-				opt_ipv6 = true;
+				query->filter.opt_ipv6 = true;
+			else if (strcmp (option_ptr, "binary") == 0)
+				query->filter.opt_binary = true;
+			else if (strcmp (option_ptr, "info") == 0)
+				query->filter.opt_info = true;
+
+			// Filters on the infostrings
+			else if (strncmp (option_ptr, "map=", 4) == 0 && option_ptr[4] != '\0')
+			{
+				CopyLowercase (query->filter.mapname, option_ptr + 4, sizeof (query->filter.mapname));
+				query->filter.opt_map = true;
+			}
+			else if (strncmp (option_ptr, "minplayers=", 11) == 0)
+				query->filter.min_players = (unsigned int)strtoul (option_ptr + 11, NULL, 10);
+			else if (strncmp (option_ptr, "hostname=", 9) == 0 && option_ptr[9] != '\0')
+			{
+				CopyLowercase (query->filter.hostname, option_ptr + 9, sizeof (query->filter.hostname));
+				query->filter.opt_hostname = true;
+			}
+
+			// Delta lists: "delta" asks for a full list with a generation
+			// number, "delta=<generation>" for the changes since then
+			else if (strcmp (option_ptr, "delta") == 0)
+				query->opt_delta = true;
+			else if (strncmp (option_ptr, "delta=", 6) == 0)
+			{
+				const char* gen_string = option_ptr + 6;
+
+				query->delta_base = (unsigned int)strtoul (gen_string, &end_ptr, 10);
+				if (end_ptr != gen_string && *end_ptr == '\0')
+				{
+					query->opt_delta = true;
+					query->has_delta_base = true;
+				}
+			}
+
+			// Paged lists: "page" asks for the first page, "page=<token>"
+			// for the next one, the token being given by the previous page
+			else if (strcmp (option_ptr, "page") == 0)
+				query->opt_page = true;
+			else if (strncmp (option_ptr, "page=", 5) == 0)
+			{
+				const char* gen_string = option_ptr + 5;
+
+				query->opt_page = true;
+				query->page_generation = (unsigned int)strtoul (gen_string, &end_ptr, 10);
+				if (end_ptr != gen_string && *end_ptr == ':')
+				{
+					const char* cursor_string = end_ptr + 1;
+
+					query->page_cursor = (unsigned int)strtoul (cursor_string, &end_ptr, 10);
+					if (end_ptr != cursor_string && *end_ptr == '\0')
+						query->has_page_token = true;
+				}
+			}
 		}
 		option_ptr = strtok (NULL, " ");
 	}
 
 	// If no IP version was given for the filtering, accept any version
-	if (! opt_ipv4 && ! opt_ipv6)
+	if (! query->filter.opt_ipv4 && ! query->filter.opt_ipv6)
 	{
-		opt_ipv4 = true;
-		opt_ipv6 = true;
+		query->filter.opt_ipv4 = true;
+		query->filter.opt_ipv6 = true;
 	}
 
-	// Initialize the packet contents with the header
-	if (extended_request)
-		packetheader = "\xFF\xFF\xFF\xFF" M2C_GETSERVERSEXTREPONSE;
-	else
-		packetheader = "\xFF\xFF\xFF\xFF" M2C_GETSERVERSREPONSE "\0";
-	headersize = strlen (packetheader);
-	packetind = headersize;
-	memcpy(packet, packetheader, headersize);
-
-	// Add every relevant server
-	nb_servers = 0;
-	for (sv = Sv_GetFirst (); sv != NULL;  sv = Sv_GetNext ())
+	// Normalize the filters (the change log doesn't track the infostrings)
+	if (query->opt_delta)
 	{
-		size_t next_sv_size;
+		query->filter.delta_list = true;
+		query->filter.opt_info = false;
+		query->filter.opt_map = false;
+		memset (query->filter.mapname, 0, sizeof (query->filter.mapname));
+		query->filter.min_players = 0;
+		query->filter.opt_hostname = false;
+		memset (query->filter.hostname, 0, sizeof (query->filter.hostname));
+	}
+	if (! query->filter.opt_gametype)
+		memset (query->filter.gametype, 0, sizeof (query->filter.gametype));
 
-		assert (sv->state != sv_state_unused_slot);
+	return true;
+}
 
-		// Extra debugging info
-		if (max_msg_level >= MSG_DEBUG)
-		{
-			const char * addrstr = Sys_SockaddrToString (&sv->address, sv->addrlen);
-			Com_Printf (MSG_DEBUG,
-						"  - Comparing server: IP:\"%s\", p:%d, g:\"%s\"\n",
-						addrstr, sv->protocol, sv->gamename);
-
-			if (sv->state <= sv_state_uninitialized)
-				Com_Printf (MSG_DEBUG,
-							"    Reject: server is not initialized\n");
-			if (sv->protocol != protocol)
-				Com_Printf (MSG_DEBUG,
-							"    Reject: protocol %d != requested %d\n",
-							sv->protocol, protocol);
-			if (! opt_empty && sv->state == sv_state_empty)
-				Com_Printf (MSG_DEBUG, "    Reject: no empty server allowed\n");
-			if (! opt_full && sv->state == sv_state_full)
-				Com_Printf (MSG_DEBUG, "    Reject: no full server allowed\n");
-			if (! opt_ipv4 && sv->address.ss_family == AF_INET)
-				Com_Printf (MSG_DEBUG, "    Reject: no IPv4 servers allowed\n");
-			if (! opt_ipv6 && sv->address.ss_family == AF_INET6)
-				Com_Printf (MSG_DEBUG, "    Reject: no IPv6 servers allowed\n");
-			if (opt_gametype && strcmp (gametype, sv->gametype) != 0)
-				Com_Printf (MSG_DEBUG,
-							"    Reject: gametype \"%s\" != requested \"%s\"\n",
-							sv->gametype, gametype);
-			if (strcmp (gamename, sv->gamename) != 0)
-				Com_Printf (MSG_DEBUG,
-							"    Reject: gamename \"%s\" != requested \"%s\"\n",
-							sv->gamename, gamename);
-		}
-
-		// Check protocols, options, and gamename
-		if (sv->state <= sv_state_uninitialized ||
-			sv->protocol != protocol ||
-			(! opt_empty && sv->state == sv_state_empty) ||
-			(! opt_full && sv->state == sv_state_full) ||
-			(! opt_ipv4 && sv->address.ss_family == AF_INET) ||
-			(! opt_ipv6 && sv->address.ss_family == AF_INET6) ||
-			(opt_gametype && strcmp (gametype, sv->gametype) != 0) ||
-			strcmp (gamename, sv->gamename) != 0)
-		{
-			// Skip it
-			continue;
-		}
 
-		// If the packet doesn't have enough free space for this server
-		next_sv_size = (sv->address.ss_family == AF_INET ? 4 : 16) + 3;
-		if (packetind +  13 > sizeof (packet))
-		{
-			// Send the packet to the client
-			if (sendto (recv_socket, (void*)packet, packetind, 0,
-					(const struct sockaddr*)addr, addrlen) < 0)
-				Com_Printf (MSG_WARNING, "> WARNING: can't send %s (%s)\n",
-							request_name, Sys_GetLastNetErrorString ());
-			else
-				Com_Printf (MSG_NORMAL, "> %s <--- %sResponse (%u servers)\n",
-							peer_address, request_name, nb_servers);
-			
-			// Reset the packet index (no need to change the header)
-			packetind = headersize;
-			nb_servers = 0;
-		}
+/*
+====================
+IsServerMatching
 
-		if (sv->address.ss_family == AF_INET)
-		{
-			const struct sockaddr_in* sv_sockaddr;
-			unsigned int sv_addr;
-			unsigned short sv_port;
+Check if a server matches the filters of a getservers request
+====================
+*/
+static qboolean IsServerMatching (const server_t* sv, const getservers_filter_t* filter)
+{
+	assert (sv->state != sv_state_unused_slot);
 
-			sv_sockaddr = (const struct sockaddr_in *)&sv->address;
-			sv_addr = ntohl (sv_sockaddr->sin_addr.s_addr);
-			sv_port = ntohs (sv_sockaddr->sin_port);
+	// Extra debugging info
+	if (max_msg_level >= MSG_DEBUG)
+	{
+		const char * addrstr = Sys_SockaddrToString (&sv->address, sv->addrlen);
+		Com_Printf (MSG_DEBUG,
+					"  - Comparing server: IP:\"%s\", p:%d, g:\"%s\"\n",
+					addrstr, sv->protocol, sv->gamename);
 
-			// Use the address mapping associated with the server, if any
-			if (sv->addrmap != NULL)
-			{
-				const addrmap_t* addrmap = sv->addrmap;
+		if (sv->state <= sv_state_uninitialized)
+			Com_Printf (MSG_DEBUG,
+						"    Reject: server is not initialized\n");
+		if (sv->protocol != filter->protocol)
+			Com_Printf (MSG_DEBUG,
+						"    Reject: protocol %d != requested %d\n",
+						sv->protocol, filter->protocol);
+		if (! filter->opt_empty && sv->state == sv_state_empty)
+			Com_Printf (MSG_DEBUG, "    Reject: no empty server allowed\n");
+		if (! filter->opt_full && sv->state == sv_state_full)
+			Com_Printf (MSG_DEBUG, "    Reject: no full server allowed\n");
+		if (! filter->opt_ipv4 && sv->address.ss_family == AF_INET)
+			Com_Printf (MSG_DEBUG, "    Reject: no IPv4 servers allowed\n");
+		if (! filter->opt_ipv6 && sv->address.ss_family == AF_INET6)
+			Com_Printf (MSG_DEBUG, "    Reject: no IPv6 servers allowed\n");
+		if (filter->opt_gametype && strcmp (filter->gametype, sv->gametype) != 0)
+			Com_Printf (MSG_DEBUG,
+						"    Reject: gametype \"%s\" != requested \"%s\"\n",
+						sv->gametype, filter->gametype);
+		if (strcmp (filter->gamename, sv->gamename) != 0)
+			Com_Printf (MSG_DEBUG,
+						"    Reject: gamename \"%s\" != requested \"%s\"\n",
+						sv->gamename, filter->gamename);
+		if (filter->opt_map && strcmp (filter->mapname, sv->mapname) != 0)
+			Com_Printf (MSG_DEBUG,
+						"    Reject: map \"%s\" != requested \"%s\"\n",
+						sv->mapname, filter->mapname);
+		if (sv->nb_clients < filter->min_players)
+			Com_Printf (MSG_DEBUG,
+						"    Reject: %u player(s) < requested %u\n",
+						sv->nb_clients, filter->min_players);
+		if (filter->opt_hostname && strstr (sv->hostname, filter->hostname) == NULL)
+			Com_Printf (MSG_DEBUG,
+						"    Reject: host name \"%s\" doesn't contain \"%s\"\n",
+						sv->hostname, filter->hostname);
+	}
 
-				sv_addr = ntohl (addrmap->to.sin_addr.s_addr);
-				if (addrmap->to.sin_port != 0)
-					sv_port = ntohs (addrmap->to.sin_port);
+	// Check protocols, options, and gamename
+	return (sv->state > sv_state_uninitialized &&
+			sv->protocol == filter->protocol &&
+			(filter->opt_empty || sv->state != sv_state_empty) &&
+			(filter->opt_full || sv->state != sv_state_full) &&
+			(filter->opt_ipv4 || sv->address.ss_family != AF_INET) &&
+			(filter->opt_ipv6 || sv->address.ss_family != AF_INET6) &&
+			(! filter->opt_gametype || strcmp (filter->gametype, sv->gametype) == 0) &&
+			strcmp (filter->gamename, sv->gamename) == 0 &&
+			(! filter->opt_map || strcmp (filter->mapname, sv->mapname) == 0) &&
+			sv->nb_clients >= filter->min_players &&
+			(! filter->opt_hostname || strstr (sv->hostname, filter->hostname) != NULL));
+}
 
-				Com_Printf (MSG_DEBUG,
-							"  - Using mapped address %u.%u.%u.%u:%hu\n",
-							sv_addr >> 24, (sv_addr >> 16) & 0xFF,
-							(sv_addr >>  8) & 0xFF, sv_addr & 0xFF,
-							sv_port);
-			}
 
-			// Heading '\'
-			packet[packetind    ] = '\\';
+/*
+====================
+IsListingMatching
 
-			// IP address
-			/*packet[packetind + 1] = (sv_addr >> 24);
-			packet[packetind + 2] = ((sv_addr >> 16) & 0xFF);
-			packet[packetind + 3] = ((sv_addr >>  8) & 0xFF);
-			packet[packetind + 4] =  (sv_addr        & 0xFF);*/
+Check if a server, listed as recorded in the change log, matched the filters
+of a delta request (they don't check the infostrings, see ParseGetServers)
+====================
+*/
+static qboolean IsListingMatching (const sv_listing_t* listing, sa_family_t addr_family,
+								   const getservers_filter_t* filter)
+{
+	return (listing->state > sv_state_uninitialized &&
+			listing->protocol == filter->protocol &&
+			(filter->opt_empty || listing->state != sv_state_empty) &&
+			(filter->opt_full || listing->state != sv_state_full) &&
+			(filter->opt_ipv4 || addr_family != AF_INET) &&
+			(filter->opt_ipv6 || addr_family != AF_INET6) &&
+			(! filter->opt_gametype || strcmp (filter->gametype, listing->gametype) == 0) &&
+			strcmp (filter->gamename, listing->gamename) == 0);
+}
 
-			sprintf(buffer, "%x", (sv_addr >> 24));
-			if(!buffer[1] || buffer[1] == '\0') {
-				buffer[1] = buffer[0];
-				buffer[0] = '0';
-			}
-			packet[packetind + 1] = buffer[0];
-			packet[packetind + 2] = buffer[1];
 
-			sprintf(buffer, "%x", ((sv_addr >> 16) & 0xFF));
-			if(!buffer[1] || buffer[1] == '\0') {
-				buffer[1] = buffer[0];
-				buffer[0] = '0';
-			}
-			packet[packetind + 3] = buffer[0];
-			packet[packetind + 4] = buffer[1];
+/*
+====================
+EncodeHex
 
-			sprintf(buffer, "%x", ((sv_addr >> 8) & 0xFF));
-			if(!buffer[1] || buffer[1] == '\0') {
-				buffer[1] = buffer[0];
-				buffer[0] = '0';
-			}
-			packet[packetind + 5] = buffer[0];
-			packet[packetind + 6] = buffer[1];
+Write a series of bytes as pairs of lowercase hexadecimal digits (no '\0' added)
+====================
+*/
+static void EncodeHex (qbyte* dest, const qbyte* src, size_t nb_bytes)
+{
+	static const char hex_digits [16] = {
+		'0', '1', '2', '3', '4', '5', '6', '7',
+		'8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+	};
+	size_t ind;
 
-			sprintf(buffer, "%x", (sv_addr & 0xFF));
-			if(!buffer[1] || buffer[1] == '\0') {
-				buffer[1] = buffer[0];
-				buffer[0] = '0';
-			}
-			packet[packetind + 7] = buffer[0];
-			packet[packetind + 8] = buffer[1];
-
-			// Port
-			//packet[packetind + 5] = (sv_port >> 8);
-			//packet[packetind + 6] = (sv_port & 0xFF);
-			/*packet[packetind + 5] = (sv_port - 16) & 0xFF;
-			packet[packetind + 6] = (sv_port >> 8) & 0xFF;
-			packet[packetind + 7] = (sv_port >> 12) & 0xFF;*/
-			
-			port1 = sv_port;
-			port2 = port1 - (((int)(port1 / 256)) * 256);
-			port1 = ((int)(port1 / 256));
-
-			sprintf(buffer, "%x", port1);
-			if(!buffer[1] || buffer[1] == '\0') {
-				buffer[1] = buffer[0];
-				buffer[0] = '0';
-			}
-			packet[packetind + 9] = buffer[0];
-			packet[packetind + 10] = buffer[1];
+	for (ind = 0; ind < nb_bytes; ind++)
+	{
+		dest[2 * ind] = hex_digits[src[ind] >> 4];
+		dest[2 * ind + 1] = hex_digits[src[ind] & 0x0F];
+	}
+}
 
-			sprintf(buffer, "%x", port2);
-			if(!buffer[1] || buffer[1] == '\0') {
-				buffer[1] = buffer[0];
-				buffer[0] = '0';
-			}
-			packet[packetind + 11] = buffer[0];
-			packet[packetind + 12] = buffer[1];
 
-			/*Com_Printf (MSG_DEBUG, "  - Sending server %u.%u.%u.%u:%hu\n",
-						packet[packetind + 1], packet[packetind + 2],
-						packet[packetind + 3], packet[packetind + 4],
-						sv_port);*/
+/*
+====================
+WriteServerRecord
 
-			Com_Printf(MSG_DEBUG, "\npacket = %s\n", packet);
+Write the record of a server address in a getservers response, and return its size.
+IPv4 addresses are in hexadecimal for EF2 clients, or in binary if "binary" is set.
+It is done once for all, when the server enters the list
+====================
+*/
+static size_t WriteServerRecord (qbyte* record, const struct sockaddr_storage* address,
+								 const addrmap_t* addrmap, qboolean binary)
+{
+	if (address->ss_family == AF_INET)
+	{
+		const struct sockaddr_in* sv_sockaddr;
+		unsigned int sv_addr;
+		unsigned short sv_port;
+		qbyte raw_record [6];
 
-			//packetind += 7;
-			packetind += 13;
+		sv_sockaddr = (const struct sockaddr_in *)address;
+		sv_addr = ntohl (sv_sockaddr->sin_addr.s_addr);
+		sv_port = ntohs (sv_sockaddr->sin_port);
+
+		// Use the address mapping associated with the server, if any
+		if (addrmap != NULL)
+		{
+			sv_addr = ntohl (addrmap->to.sin_addr.s_addr);
+			if (addrmap->to.sin_port != 0)
+				sv_port = ntohs (addrmap->to.sin_port);
+
+			Com_Printf (MSG_DEBUG,
+						"  - Using mapped address %u.%u.%u.%u:%hu\n",
+						sv_addr >> 24, (sv_addr >> 16) & 0xFF,
+						(sv_addr >>  8) & 0xFF, sv_addr & 0xFF,
+						sv_port);
 		}
+
+		// Heading '\'
+		record[0] = '\\';
+
+		// IP address and port
+		raw_record[0] = (qbyte)(sv_addr >> 24);
+		raw_record[1] = (qbyte)(sv_addr >> 16);
+		raw_record[2] = (qbyte)(sv_addr >> 8);
+		raw_record[3] = (qbyte)sv_addr;
+		raw_record[4] = (qbyte)(sv_port >> 8);
+		raw_record[5] = (qbyte)sv_port;
+
+		if (binary)
+		{
+			memcpy (&record[1], raw_record, sizeof (raw_record));
+			return 1 + sizeof (raw_record);
+		}
+
+		// EF2 wants them in lowercase hexadecimal
+		EncodeHex (&record[1], raw_record, sizeof (raw_record));
+		return 1 + 2 * sizeof (raw_record);
+	}
+	else
+	{
+		const struct sockaddr_in6* sv_sockaddr6;
+		unsigned short sv_port;
+
+		sv_sockaddr6 = (const struct sockaddr_in6 *)address;
+
+		// Heading '/'
+		record[0] = '/';
+
+		// IP address
+		memcpy (&record[1], &sv_sockaddr6->sin6_addr.s6_addr,
+				sizeof(sv_sockaddr6->sin6_addr.s6_addr));
+
+		// Port
+		sv_port = ntohs (sv_sockaddr6->sin6_port);
+		record[17] = sv_port >> 8;
+		record[18] = sv_port & 0xFF;
+
+		return 19;
+	}
+}
+
+
+/*
+====================
+InitResponse
+
+Start a new response to a client
+====================
+*/
+static void InitResponse (response_t* response, const char* header, const char* request_name,
+						  const struct sockaddr_storage* addr, socklen_t addrlen, socket_t sock)
+{
+	response->headersize = strlen (header);
+	assert (response->headersize < sizeof (response->packet) - MAX_RECORD_SIZE);
+	memcpy (response->packet, header, response->headersize);
+	response->cache = NULL;
+	response->packetind = response->headersize;
+	response->nb_servers = 0;
+	response->request_name = request_name;
+	response->addr = addr;
+	response->addrlen = addrlen;
+	response->sock = sock;
+}
+
+
+/*
+====================
+InitListResponse
+
+Start a response containing the servers matching a request. The
+generation in the header of a delta list is the one of the list when
+we start browsing it: the changes made meanwhile may or may not be in
+the response, but the client will get them again with its next delta
+====================
+*/
+static void InitListResponse (response_t* response, const getservers_query_t* query,
+							  const struct sockaddr_storage* addr, socklen_t addrlen, socket_t sock)
+{
+	char delta_header [64];
+	const char* header;
+
+	if (query->filter.delta_list)
+	{
+		snprintf (delta_header, sizeof (delta_header), "\xFF\xFF\xFF\xFF" M2C_GETSERVERSDELTAREPONSE " %u full\n",
+				  Sv_GetGeneration ());
+		delta_header[sizeof (delta_header) - 1] = '\0';
+		header = delta_header;
+	}
+	else if (query->filter.opt_info)
+		header = "\xFF\xFF\xFF\xFF" M2C_GETSERVERSINFOREPONSE;
+	else if (query->filter.extended)
+		header = "\xFF\xFF\xFF\xFF" M2C_GETSERVERSEXTREPONSE;
+	else
+		header = "\xFF\xFF\xFF\xFF" M2C_GETSERVERSREPONSE;
+
+	InitResponse (response, header, query->request_name, addr, addrlen, sock);
+}
+
+
+/*
+====================
+UsesInfostrings
+
+Check if the response to a request depends on the server infostrings
+====================
+*/
+static qboolean UsesInfostrings (const getservers_filter_t* filter)
+{
+	return (filter->opt_info || filter->opt_map ||
+			filter->min_players > 0 || filter->opt_hostname);
+}
+
+
+/*
+====================
+GetCachedResponse
+
+Return the prerendered response for these filters, or NULL if it's not up to
+date. The response may still be being built
+====================
+*/
+static cached_response_t* GetCachedResponse (const getservers_filter_t* filter)
+{
+	unsigned int crt_gen = Sv_GetGeneration ();
+	unsigned int ind;
+
+	for (ind = 0; ind < RESPONSE_CACHE_SIZE; ind++)
+	{
+		cached_response_t* entry = &response_cache[ind];
+
+		if (entry->in_use && entry->generation == crt_gen &&
+			(! UsesInfostrings (filter) || entry->info_generation == info_generation) &&
+			memcmp (&entry->filter, filter, sizeof (*filter)) == 0)
+		{
+			entry->last_use = ++response_cache_clock;
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+====================
+NewCachedResponse
+
+Get an empty cache entry for a new prerendered response. It
+replaces the old response for these filters if there's one,
+or else the least recently used entry. Entries used by response
+jobs can't be replaced, so it returns NULL if they all are
+====================
+*/
+static cached_response_t* NewCachedResponse (const getservers_filter_t* filter)
+{
+	cached_response_t* entry = NULL;
+	unsigned int ind;
+
+	for (ind = 0; ind < RESPONSE_CACHE_SIZE; ind++)
+	{
+		cached_response_t* crt_entry = &response_cache[ind];
+
+		if (crt_entry->nb_users > 0)
+			continue;
+
+		if (crt_entry->in_use && memcmp (&crt_entry->filter, filter, sizeof (*filter)) == 0)
+		{
+			entry = crt_entry;
+			break;
+		}
+
+		if (entry == NULL)
+			entry = crt_entry;
+		else if (! crt_entry->in_use)
+		{
+			if (entry->in_use)
+				entry = crt_entry;
+		}
+		else if (entry->in_use && crt_entry->last_use - entry->last_use > UINT_MAX / 2)
+			entry = crt_entry;
+	}
+
+	if (entry == NULL)
+		return NULL;
+
+	// The packet buffer is kept for the next response
+	entry->in_use = false;
+	entry->filter = *filter;
+	entry->nb_packets = 0;
+	entry->last_use = ++response_cache_clock;
+	return entry;
+}
+
+
+/*
+====================
+SendCachedPacket
+
+Send a packet of a prerendered response to a client. Since any packet
+may be sent last, the EOT mark is added when the packet is sent
+====================
+*/
+static void SendCachedPacket (const cached_packet_t* packet, qboolean is_last, const queued_query_t* request)
+{
+	qbyte last_packet [MAX_PACKET_SIZE_OUT];
+	const qbyte* data = packet->data;
+	size_t size = packet->size;
+
+	if (is_last)
+	{
+		memcpy (last_packet, packet->data, size);
+		memcpy (&last_packet[size], eot_mark, sizeof (eot_mark));
+		data = last_packet;
+		size += sizeof (eot_mark);
+	}
+
+	if (! Out_SendTo (request->sock, data, size, &request->addr, request->addrlen))
+		Com_Printf (MSG_WARNING, "> WARNING: can't send %s (outbound queue full)\n",
+					request->query.request_name);
+	else
+		Com_Printf (MSG_NORMAL, "> %s <--- %sResponse (%u servers)\n",
+					peer_address, request->query.request_name, packet->nb_servers);
+}
+
+
+/*
+====================
+StoreResponsePacket
+
+Store the current packet of a response in its cache entry
+====================
+*/
+static qboolean StoreResponsePacket (response_t* response)
+{
+	cached_response_t* entry = response->cache;
+	cached_packet_t* packet;
+
+	if (entry->nb_packets == entry->max_packets)
+	{
+		unsigned int new_max = (entry->max_packets == 0) ? 8 : entry->max_packets * 2;
+		cached_packet_t* new_packets;
+
+		new_packets = realloc (entry->packets, new_max * sizeof (*new_packets));
+		if (new_packets == NULL)
+			return false;
+		entry->packets = new_packets;
+		entry->max_packets = new_max;
+	}
+
+	packet = &entry->packets[entry->nb_packets++];
+	packet->size = response->packetind;
+	packet->nb_servers = response->nb_servers;
+	memcpy (packet->data, response->packet, response->packetind);
+	return true;
+}
+
+
+/*
+====================
+SendResponsePacket
+
+Send the current packet of a response (or store it if
+the response is being prerendered), and start a new one
+====================
+*/
+static void SendResponsePacket (response_t* response)
+{
+	// A prerendered response has no client: if the packet
+	// can't be stored, the whole prerendering fails
+	if (response->cache != NULL)
+	{
+		if (! StoreResponsePacket (response))
+		{
+			Com_Printf (MSG_WARNING,
+						"> WARNING: can't allocate memory for a prerendered %sResponse\n",
+						response->request_name);
+			response->cache = NULL;
+		}
+	}
+	else if (! Out_SendTo (response->sock, response->packet, response->packetind,
+						   response->addr, response->addrlen))
+		Com_Printf (MSG_WARNING, "> WARNING: can't send %s (outbound queue full)\n",
+					response->request_name);
+	else
+		Com_Printf (MSG_NORMAL, "> %s <--- %sResponse (%u servers)\n",
+					peer_address, response->request_name, response->nb_servers);
+
+	// Reset the packet index (no need to change the header)
+	response->packetind = response->headersize;
+	response->nb_servers = 0;
+}
+
+
+/*
+====================
+AddToResponse
+
+Add a record to a response, sending the current packet first if it's full.
+Prerendered packets keep some room for the EOT mark, since any of them may
+be the last one sent
+====================
+*/
+static void AddToResponse (response_t* response, const qbyte* record, size_t size)
+{
+	size_t max_size = sizeof (response->packet);
+
+	if (response->cache != NULL)
+		max_size -= sizeof (eot_mark);
+	if (response->packetind + size > max_size)
+		SendResponsePacket (response);
+
+	memcpy (&response->packet[response->packetind], record, size);
+	response->packetind += size;
+	response->nb_servers++;
+}
+
+
+/*
+====================
+WriteServerEntry
+
+Write the entry of a server in a getservers response: its record,
+followed by its infostring and a '\0' if the client asked for it
+====================
+*/
+static size_t WriteServerEntry (qbyte* entry, const server_t* sv, const getservers_filter_t* filter)
+{
+	size_t size;
+
+	if (filter->opt_binary)
+	{
+		memcpy (entry, sv->binary_record, sv->binary_record_size);
+		size = sv->binary_record_size;
+	}
+	else
+	{
+		memcpy (entry, sv->record, sv->record_size);
+		size = sv->record_size;
+	}
+
+	if (filter->opt_info)
+	{
+		const char* infostring;
+		size_t info_length;
+
+		infostring = Sv_GetInfostring (sv, &info_length);
+		memcpy (&entry[size], infostring, info_length);
+		size += info_length;
+		entry[size++] = '\0';
+	}
+
+	return size;
+}
+
+
+/*
+====================
+AddServerToResponse
+
+Add the entry of a server to a response
+====================
+*/
+static void AddServerToResponse (response_t* response, const server_t* sv, const getservers_filter_t* filter)
+{
+	qbyte entry [MAX_ENTRY_SIZE];
+	size_t size;
+
+	// Most of the time, no need to copy the record
+	if (! filter->opt_info)
+	{
+		if (filter->opt_binary)
+			AddToResponse (response, sv->binary_record, sv->binary_record_size);
 		else
+			AddToResponse (response, sv->record, sv->record_size);
+		return;
+	}
+
+	size = WriteServerEntry (entry, sv, filter);
+	AddToResponse (response, entry, size);
+}
+
+
+/*
+====================
+FinishResponse
+
+Add the End Of Transmission mark to a response and send its last packet
+====================
+*/
+static void FinishResponse (response_t* response)
+{
+	// Prerendered responses get their EOT mark when they're sent
+	if (response->cache != NULL)
+	{
+		if (response->nb_servers > 0 || response->cache->nb_packets == 0)
+			SendResponsePacket (response);
+		return;
+	}
+
+	// If the packet doesn't have enough free space for the EOT mark
+	if (response->packetind + sizeof (eot_mark) > sizeof (response->packet))
+		SendResponsePacket (response);
+
+	memcpy (&response->packet[response->packetind], eot_mark, sizeof (eot_mark));
+	response->packetind += sizeof (eot_mark);
+
+	SendResponsePacket (response);
+}
+
+
+/*
+====================
+HashBytes
+
+Add a series of bytes to a FNV-1a hash value
+====================
+*/
+static unsigned int HashBytes (unsigned int hash, const void* data, size_t size)
+{
+	const qbyte* bytes = (const qbyte*)data;
+	size_t ind;
+
+	for (ind = 0; ind < size; ind++)
+	{
+		hash ^= bytes[ind];
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+
+/*
+====================
+AddDeltaChanges
+
+Add the changes since the base generation of a delta request to the response.
+Return false if the change log doesn't go back that far
+====================
+*/
+static qboolean AddDeltaChanges (response_t* response, const getservers_query_t* query, unsigned int crt_gen)
+{
+	// Addresses of the servers which changed, as an open-addressing set, with their newest
+	// and their oldest change. "changed_servers" lists the set entries, newest first.
+	// A server may have used several slots meanwhile (removed, then added again),
+	// so it's identified by its address only, to get a single record per address
+	static const sv_change_t* newest_changes [2 * CHANGE_LOG_MAX_DELTA];
+	static const sv_change_t* oldest_changes [2 * CHANGE_LOG_MAX_DELTA];
+	static unsigned int changed_servers [CHANGE_LOG_MAX_DELTA];
+	unsigned int nb_changed_servers = 0;
+	unsigned int nb_changes = crt_gen - query->delta_base;
+	unsigned int set_size;
+	unsigned int gen, ind;
+
+	if (nb_changes > CHANGE_LOG_MAX_DELTA)
+		return false;
+	for (gen = query->delta_base + 1; gen != crt_gen + 1; gen++)
+		if (Sv_GetChange (gen) == NULL)
+			return false;
+
+	// The set only needs to be twice as big as the number of changes
+	for (set_size = 2; set_size < 2 * nb_changes; set_size *= 2)
+		;
+	memset (newest_changes, 0, set_size * sizeof (newest_changes[0]));
+
+	// Browse the changes from the newest to the oldest
+	for (gen = crt_gen; gen != query->delta_base; gen--)
+	{
+		const sv_change_t* change = Sv_GetChange (gen);
+		unsigned int set_ind;
+
+		// Look for this server in the set
+		set_ind = HashBytes (2166136261U, &change->address, change->addrlen) & (set_size - 1);
+		while (newest_changes[set_ind] != NULL)
+		{
+			const sv_change_t* newest = newest_changes[set_ind];
+
+			if (newest->addrlen == change->addrlen &&
+				memcmp (&newest->address, &change->address, change->addrlen) == 0)
+				break;
+			set_ind = (set_ind + 1) & (set_size - 1);
+		}
+
+		if (newest_changes[set_ind] == NULL)
+		{
+			newest_changes[set_ind] = change;
+			changed_servers[nb_changed_servers++] = set_ind;
+		}
+		oldest_changes[set_ind] = change;
+	}
+
+	// We only send the latest change of each server. Servers which don't match
+	// the filters (anymore) are sent as removed, if the client may have them
+	for (ind = 0; ind < nb_changed_servers; ind++)
+	{
+		unsigned int set_ind = changed_servers[ind];
+		const sv_change_t* change = newest_changes[set_ind];
+		const sv_change_t* oldest = oldest_changes[set_ind];
+		const server_t* sv;
+		qbyte record [1 + MAX_RECORD_SIZE];
+		const qbyte* change_record;
+		size_t change_record_size;
+
+		if (query->filter.opt_binary)
+		{
+			change_record = change->binary_record;
+			change_record_size = change->binary_record_size;
+		}
+		else
+		{
+			change_record = change->record;
+			change_record_size = change->record_size;
+		}
+
+		sv = Sv_GetByIndex (change->sv_ind);
+		if (change->type != sv_change_removed && sv != NULL &&
+			sv->addrlen == change->addrlen &&
+			memcmp (&sv->address, &change->address, change->addrlen) == 0 &&
+			IsServerMatching (sv, &query->filter))
+			AddToResponse (response, change_record, change_record_size);
+
+		// The client's list is the one of the base generation, before the oldest change
+		else if (IsListingMatching (&oldest->prev_listing, change->address.v4.sin_family,
+									&query->filter))
+		{
+			record[0] = '-';
+			memcpy (&record[1], change_record, change_record_size);
+			AddToResponse (response, record, 1 + change_record_size);
+		}
+	}
+
+	return true;
+}
+
+
+/*
+====================
+HashGetServersQuery
+
+Hash the parameters of a getservers request
+====================
+*/
+static unsigned int HashGetServersQuery (const getservers_query_t* query)
+{
+	unsigned int query_hash;
+
+	// The query is memset before being parsed, so we can hash its raw bytes
+	query_hash = HashBytes (2166136261U, &query->filter, sizeof (query->filter));
+	query_hash = HashBytes (query_hash, &query->opt_delta, sizeof (query->opt_delta));
+	query_hash = HashBytes (query_hash, &query->has_delta_base, sizeof (query->has_delta_base));
+	query_hash = HashBytes (query_hash, &query->delta_base, sizeof (query->delta_base));
+	query_hash = HashBytes (query_hash, &query->opt_page, sizeof (query->opt_page));
+	query_hash = HashBytes (query_hash, &query->page_generation, sizeof (query->page_generation));
+	query_hash = HashBytes (query_hash, &query->page_cursor, sizeof (query->page_cursor));
+
+	return query_hash;
+}
+
+
+/*
+====================
+IsBeingAnswered
+
+Check if a response job is still sending the answer to the same request
+from the same client. A long list can take several seconds to be sent
+====================
+*/
+static qboolean IsBeingAnswered (unsigned int query_hash,
+								 const struct sockaddr_storage* addr, socklen_t addrlen)
+{
+	unsigned int ind;
+
+	if (nb_response_jobs == 0)
+		return false;
+
+	for (ind = 0; ind < MAX_RESPONSE_JOBS; ind++)
+	{
+		const response_job_t* job = &response_jobs[ind];
+
+		if (job->in_use && job->request.addrlen == addrlen &&
+			memcmp (&job->request.addr, addr, addrlen) == 0 &&
+			HashGetServersQuery (&job->request.query) == query_hash)
+			return true;
+	}
+
+	return false;
+}
+
+
+/*
+====================
+IsGetServersRetry
+
+Check if a client has already made the same getservers request in
+the last few seconds, or if we are still sending the answer to it.
+If not, remember this request for later
+====================
+*/
+static qboolean IsGetServersRetry (const getservers_query_t* query,
+								   const struct sockaddr_storage* addr, socklen_t addrlen)
+{
+	unsigned int query_hash, bucket_ind, entry_ind;
+	recent_query_t* bucket;
+	recent_query_t* oldest = NULL;
+
+	query_hash = HashGetServersQuery (query);
+
+	// The client will get the whole answer anyway, however long it takes
+	if (IsBeingAnswered (query_hash, addr, addrlen))
+		return true;
+
+	bucket_ind = HashBytes (query_hash, addr, addrlen) % RECENT_QUERIES_NB_BUCKETS;
+	bucket = recent_queries[bucket_ind];
+
+	for (entry_ind = 0; entry_ind < RECENT_QUERIES_BUCKET_SIZE; entry_ind++)
+	{
+		recent_query_t* entry = &bucket[entry_ind];
+
+		if (entry->addrlen == addrlen && entry->query_hash == query_hash &&
+			memcmp (&entry->addr, addr, addrlen) == 0)
+		{
+			// Retries don't extend the window, or an impatient
+			// client could end up never getting an answer
+			if (crt_time - entry->time < (time_t)getservers_retry_window)
+				return true;
+
+			entry->time = crt_time;
+			return false;
+		}
+
+		if (oldest == NULL || entry->addrlen == 0 ||
+			(oldest->addrlen != 0 && entry->time < oldest->time))
+			oldest = entry;
+	}
+
+	memcpy (&oldest->addr, addr, addrlen);
+	oldest->addrlen = addrlen;
+	oldest->query_hash = query_hash;
+	oldest->time = crt_time;
+	return false;
+}
+
+
+/*
+====================
+SendGetServersPage
+
+Send one page of the server list, made of the matching servers
+which fit in a packet, starting at the slot given by the client.
+At most PAGE_MAX_SCANNED_SLOTS slots are browsed for a page, so
+the cursor returned is where the browsing stopped
+====================
+*/
+static void SendGetServersPage (const getservers_query_t* query, const struct sockaddr_storage* addr,
+								socklen_t addrlen, socket_t sock)
+{
+	static const char max_header [] =
+		"\xFF\xFF\xFF\xFF" M2C_GETSERVERSPAGEREPONSE " 4294967295:4294967295\n";
+	qbyte records [MAX_PACKET_SIZE_OUT];
+	size_t records_size = 0;
+	size_t max_records_size = MAX_PACKET_SIZE_OUT - (sizeof (max_header) - 1) - sizeof (eot_mark);
+	unsigned int nb_servers = 0;
+	unsigned int nb_slots = Sv_GetNbSlots ();
+	unsigned int generation;
+	unsigned int sv_ind, max_ind;
+	response_t response;
+	char header [sizeof (max_header)];
+
+	// The generation is the one of the first page, so the client can ask
+	// for the changes which occured while it was browsing the pages
+	if (query->has_page_token)
+	{
+		generation = query->page_generation;
+		sv_ind = query->page_cursor;
+	}
+	else
+	{
+		generation = Sv_GetGeneration ();
+		sv_ind = 0;
+	}
+
+	max_ind = nb_slots;
+	if (sv_ind < nb_slots && nb_slots - sv_ind > PAGE_MAX_SCANNED_SLOTS)
+		max_ind = sv_ind + PAGE_MAX_SCANNED_SLOTS;
+
+	for (; sv_ind < max_ind; sv_ind++)
+	{
+		const server_t* sv = Sv_GetByIndex (sv_ind);
+		qbyte entry [MAX_ENTRY_SIZE];
+		size_t entry_size;
+
+		if (sv == NULL || ! IsServerMatching (sv, &query->filter))
+			continue;
+
+		// If the page is full, this server will be the first of the next one
+		entry_size = WriteServerEntry (entry, sv, &query->filter);
+		if (records_size + entry_size > max_records_size)
+			break;
+
+		memcpy (&records[records_size], entry, entry_size);
+		records_size += entry_size;
+		nb_servers++;
+	}
+
+	if (sv_ind < nb_slots)
+		snprintf (header, sizeof (header), "\xFF\xFF\xFF\xFF" M2C_GETSERVERSPAGEREPONSE " %u:%u\n",
+				  generation, sv_ind);
+	else
+		snprintf (header, sizeof (header), "\xFF\xFF\xFF\xFF" M2C_GETSERVERSPAGEREPONSE " %u:end\n",
+				  generation);
+	header[sizeof (header) - 1] = '\0';
+
+	InitResponse (&response, header, query->request_name, addr, addrlen, sock);
+	memcpy (&response.packet[response.packetind], records, records_size);
+	response.packetind += records_size;
+	response.nb_servers = nb_servers;
+	FinishResponse (&response);
+}
+
+
+/*
+====================
+SendUncachedResponse
+
+Send the list of the servers matching a request without prerendering it
+====================
+*/
+static void SendUncachedResponse (const queued_query_t* request)
+{
+	const getservers_filter_t* filter = &request->query.filter;
+	response_t response;
+	const server_t* sv;
+	sv_iterator_t sv_iter;
+
+	InitListResponse (&response, &request->query, &request->addr, request->addrlen, request->sock);
+
+	if (filter->opt_map)
+	{
+		for (sv = Sv_GetFirstOnMap (filter->mapname); sv != NULL; sv = Sv_GetNextOnMap (sv))
+			if (IsServerMatching (sv, filter))
+				AddServerToResponse (&response, sv, filter);
+	}
+	else
+	{
+		for (sv = Sv_GetFirst (&sv_iter); sv != NULL;  sv = Sv_GetNext (&sv_iter))
+			if (IsServerMatching (sv, filter))
+				AddServerToResponse (&response, sv, filter);
+	}
+
+	FinishResponse (&response);
+}
+
+
+/*
+====================
+StartCachedResponse
+
+Start prerendering the response to a request in a cache entry
+====================
+*/
+static void StartCachedResponse (cached_response_t* entry, const getservers_query_t* query)
+{
+	InitListResponse (&entry->builder, query, NULL, 0, INVALID_SOCKET);
+	entry->builder.cache = entry;
+	entry->walk_started = false;
+	entry->generation = Sv_GetGeneration ();
+	entry->info_generation = info_generation;
+	entry->building = true;
+	entry->in_use = true;
+}
+
+
+/*
+====================
+BuildCachedResponse
+
+Add servers to a response being prerendered, until it gets "nb_packets"
+more packets or the server list has been entirely browsed. The iterator
+copes with the changes in the list meanwhile. Requests for a given map
+only browse a short list, which may change, so they're built at once
+====================
+*/
+static void BuildCachedResponse (cached_response_t* entry, unsigned int nb_packets)
+{
+	response_t* builder = &entry->builder;
+	const getservers_filter_t* filter = &entry->filter;
+	unsigned int prev_nb_packets = entry->nb_packets;
+	qboolean walk_ended = false;
+	const server_t* sv;
+
+	if (filter->opt_map)
+	{
+		for (sv = Sv_GetFirstOnMap (filter->mapname);
+			 sv != NULL && builder->cache != NULL;
+			 sv = Sv_GetNextOnMap (sv))
+			if (IsServerMatching (sv, filter))
+				AddServerToResponse (builder, sv, filter);
+		walk_ended = true;
+	}
+	else
+	{
+		while (! walk_ended && builder->cache != NULL &&
+			   entry->nb_packets - prev_nb_packets < nb_packets)
+		{
+			if (entry->walk_started)
+				sv = Sv_GetNext (&entry->sv_iter);
+			else
+			{
+				sv = Sv_GetFirst (&entry->sv_iter);
+				entry->walk_started = true;
+			}
+
+			if (sv == NULL)
+				walk_ended = true;
+			else if (IsServerMatching (sv, filter))
+				AddServerToResponse (builder, sv, filter);
+		}
+	}
+
+	if (! walk_ended && builder->cache != NULL)
+		return;
+
+	if (builder->cache != NULL)
+		FinishResponse (builder);
+	entry->building = false;
+
+	// If the prerendering failed, the jobs using this entry will send their response without it
+	if (builder->cache == NULL)
+	{
+		entry->in_use = false;
+		entry->nb_packets = 0;
+	}
+}
+
+
+/*
+====================
+RefillJobTokens
+
+Give a paced response job the tokens it has earned since the last
+ones, at a rate of "pacing_rate" per second. It can save up to
+JOB_PACKETS_PER_SLICE tokens, for sending a few packets in a row
+====================
+*/
+static void RefillJobTokens (response_job_t* job, unsigned int now)
+{
+	unsigned int elapsed = now - job->token_time;
+	unsigned long long nb_new_tokens = (unsigned long long)elapsed * pacing_rate / 1000;
+
+	if (nb_new_tokens == 0)
+		return;
+
+	if (job->nb_tokens + nb_new_tokens >= JOB_PACKETS_PER_SLICE)
+	{
+		job->nb_tokens = JOB_PACKETS_PER_SLICE;
+		job->token_time = now;
+	}
+	else
+	{
+		job->nb_tokens += (unsigned int)nb_new_tokens;
+		job->token_time += (unsigned int)(nb_new_tokens * 1000 / pacing_rate);
+	}
+}
+
+
+/*
+====================
+AdvanceResponseJob
+
+Build or send the next packets of a getservers response, depending on
+whether its prerendering is finished or not. Unless the job is paced, it
+goes all the way to the end. Return true once the job is done
+====================
+*/
+static qboolean AdvanceResponseJob (response_job_t* job, qboolean paced)
+{
+	cached_response_t* entry = job->entry;
+	const queued_query_t* request = &job->request;
+	unsigned int nb_packets = paced ? JOB_PACKETS_PER_SLICE : UINT_MAX;
+	unsigned int nb_sent;
+
+	memcpy (peer_address, request->peer_address, sizeof (request->peer_address));
+
+	// Several jobs may be waiting for the same prerendering
+	if (entry->building)
+	{
+		BuildCachedResponse (entry, nb_packets);
+		if (entry->building)
+			return false;
+	}
+
+	// If the prerendering failed, send the response directly
+	if (! entry->in_use)
+	{
+		SendUncachedResponse (request);
+		entry->nb_users--;
+		return true;
+	}
+
+	// Start from a random packet, so that the servers at the
+	// beginning of the list don't always get the first pings
+	if (job->nb_sent == 0 && entry->nb_packets > 1)
+		job->first_packet = rand () % entry->nb_packets;
+
+	// Don't send the packets faster than the client can take them
+	if (paced && pacing_rate > 0)
+	{
+		RefillJobTokens (job, Sys_GetMilliseconds ());
+		nb_packets = job->nb_tokens;
+	}
+
+	for (nb_sent = 0; nb_sent < nb_packets && job->nb_sent < entry->nb_packets; nb_sent++)
+	{
+		const cached_packet_t* packet;
+
+		packet = &entry->packets[(job->first_packet + job->nb_sent) % entry->nb_packets];
+		job->nb_sent++;
+		SendCachedPacket (packet, job->nb_sent == entry->nb_packets, request);
+	}
+	if (paced && pacing_rate > 0)
+		job->nb_tokens -= nb_sent;
+
+	if (job->nb_sent < entry->nb_packets)
+		return false;
+
+	entry->nb_users--;
+	return true;
+}
+
+
+/*
+====================
+StartResponseJob
+
+Start answering a getservers request with a prerendered response.
+The response is built and sent a few packets at a time, interleaved
+with the other traffic, so a big list doesn't stall the master
+====================
+*/
+static void StartResponseJob (const queued_query_t* request)
+{
+	const getservers_query_t* query = &request->query;
+	response_job_t sync_job;
+	response_job_t* job = NULL;
+	cached_response_t* entry;
+	unsigned int ind;
+
+	// If the server list hasn't changed since we last answered the same
+	// request, we can send the same packets again, or wait for them
+	entry = GetCachedResponse (&query->filter);
+	if (entry == NULL)
+	{
+		entry = NewCachedResponse (&query->filter);
+		if (entry == NULL)
 		{
-			const struct sockaddr_in6* sv_sockaddr6;
-			unsigned short sv_port;
+			Com_Printf (MSG_DEBUG, "  - no prerendered response available\n");
+			SendUncachedResponse (request);
+			return;
+		}
+		StartCachedResponse (entry, query);
+	}
+	else if (entry->building)
+		Com_Printf (MSG_DEBUG, "  - waiting for a response being prerendered\n");
+	else
+		Com_Printf (MSG_DEBUG, "  - sending a prerendered response\n");
+
+	if (nb_response_jobs < MAX_RESPONSE_JOBS)
+	{
+		for (ind = 0; ind < MAX_RESPONSE_JOBS; ind++)
+			if (! response_jobs[ind].in_use)
+			{
+				job = &response_jobs[ind];
+				break;
+			}
+	}
+
+	// If there's no free job, do it all right now
+	if (job == NULL)
+		job = &sync_job;
+
+	job->request = *request;
+	job->entry = entry;
+	job->first_packet = 0;
+	job->nb_sent = 0;
+	job->nb_tokens = JOB_PACKETS_PER_SLICE;
+	job->token_time = Sys_GetMilliseconds ();
+	entry->nb_users++;
+
+	if (job == &sync_job)
+	{
+		AdvanceResponseJob (job, false);
+		return;
+	}
+
+	// Advance it right away, so that short responses are sent at once
+	if (! AdvanceResponseJob (job, true))
+	{
+		job->in_use = true;
+		nb_response_jobs++;
+	}
+}
+
+
+/*
+====================
+SendGetServersResponse
 
-			sv_sockaddr6 = (const struct sockaddr_in6 *)&sv->address;
+Send the appropriate response to a getservers request. Complete
+lists, including the full lists of delta requests, are prerendered
+and sent by response jobs
+====================
+*/
+static void SendGetServersResponse (const queued_query_t* request)
+{
+	const getservers_query_t* query = &request->query;
+	unsigned int crt_gen;
+	response_t response;
+	char header [64];
 
-			// Heading '/'
-			packet[packetind] = '/';
-			packetind += 1;
+	// Paged requests (a delta list is usually short enough already)
+	if (query->opt_page && ! query->opt_delta)
+	{
+		SendGetServersPage (query, &request->addr, request->addrlen, request->sock);
+		return;
+	}
 
-			// IP address
-			memcpy (&packet[packetind], &sv_sockaddr6->sin6_addr.s6_addr,
-					sizeof(sv_sockaddr6->sin6_addr.s6_addr));
-			packetind += sizeof(sv_sockaddr6->sin6_addr.s6_addr);
+	// Delta requests: try to send only the changes the client hasn't seen
+	if (query->has_delta_base)
+	{
+		crt_gen = Sv_GetGeneration ();
+		snprintf (header, sizeof (header), "\xFF\xFF\xFF\xFF" M2C_GETSERVERSDELTAREPONSE " %u delta\n", crt_gen);
+		header[sizeof (header) - 1] = '\0';
+		InitResponse (&response, header, query->request_name, &request->addr, request->addrlen, request->sock);
 
-			// Port
-			sv_port = ntohs (sv_sockaddr6->sin6_port);
-			packet[packetind    ] = sv_port >> 8;
-			packet[packetind + 1] = sv_port & 0xFF;
-			packetind += 2;
+		if (AddDeltaChanges (&response, query, crt_gen))
+		{
+			FinishResponse (&response);
+			return;
 		}
 
-		nb_servers++;
+		Com_Printf (MSG_DEBUG, "  - generation %u is too old, sending the full list\n",
+					query->delta_base);
 	}
 
-	// If the packet doesn't have enough free space for the EOT mark
-	if (packetind + 13 > sizeof (packet))
+	StartResponseJob (request);
+}
+
+
+/*
+====================
+HandleGetServers
+
+Parse getservers requests and queue them until the end of the current batch of packets
+====================
+*/
+static void HandleGetServers (const char* msg, const struct sockaddr_storage* addr, socklen_t addrlen, socket_t recv_socket, qboolean extended_request)
+{
+	queued_query_t* request;
+
+	// If the queue is full, empty it first (peer_address gets overwritten meanwhile)
+	if (nb_queued_queries == MAX_QUEUED_QUERIES)
 	{
-		// Send the packet to the client
-		if (sendto (recv_socket, (void*)packet, packetind, 0,
-				(const struct sockaddr*)addr, addrlen) < 0)
-			Com_Printf (MSG_WARNING, "> WARNING: can't send %s (%s)\n",
-						request_name, Sys_GetLastNetErrorString ());
-		else
-			Com_Printf (MSG_NORMAL, "> %s <--- %sResponse (%u servers)\n",
-						peer_address, request_name, nb_servers);
-		
-		// Reset the packet index (no need to change the header)
-		packetind = headersize;
-		nb_servers = 0;
-	}
-
-	// End Of Transmission
-	packet[packetind    ] = '\\';
-	packet[packetind + 1] = 'E';
-	packet[packetind + 2] = 'O';
-	packet[packetind + 3] = 'T';
-	packet[packetind + 4] = '\0';
-	packet[packetind + 5] = '\0';
-	packet[packetind + 6] = '\0';
-	packetind += 7;
-
-	// Send the packet to the client
-	if (sendto (recv_socket, (void*)packet, packetind, 0,
-			(const struct sockaddr*)addr, addrlen) < 0)
-		Com_Printf (MSG_WARNING, "> WARNING: can't send %s (%s)\n",
-					request_name, Sys_GetLastNetErrorString ());
+		char crt_peer_address [sizeof (request->peer_address)];
+
+		memcpy (crt_peer_address, peer_address, sizeof (crt_peer_address));
+		HandleQueuedQueries ();
+		memcpy (peer_address, crt_peer_address, sizeof (crt_peer_address));
+	}
+
+	request = &queued_queries[nb_queued_queries];
+	if (! ParseGetServers (msg, extended_request, &request->query))
+		return;
+
+	if (getservers_retry_window > 0 &&
+		IsGetServersRetry (&request->query, addr, addrlen))
+	{
+		Com_Printf (MSG_DEBUG, "  - retry of a request still being answered or answered less than %u second(s) ago, ignored\n",
+					getservers_retry_window);
+		return;
+	}
+
+	memcpy (&request->addr, addr, addrlen);
+	request->addrlen = addrlen;
+	request->sock = recv_socket;
+	memcpy (request->peer_address, peer_address, sizeof (request->peer_address));
+
+	nb_queued_queries++;
+}
+
+
+/*
+====================
+HandleGetServersCount
+
+Send the number of servers of each game name and protocol, or only
+of the game name given in the request. The answer is a single packet
+====================
+*/
+static void HandleGetServersCount (const char* msg, const struct sockaddr_storage* addr,
+								   socklen_t addrlen, socket_t recv_socket)
+{
+	static const char header [] = "\xFF\xFF\xFF\xFF" M2C_GETSERVERSCOUNTREPONSE "\n";
+	char packet [MAX_PACKET_SIZE_OUT];
+	size_t packetind;
+	const sv_population_t* populations;
+	unsigned int nb_populations, ind, nb_lines = 0;
+
+	// Skip the spaces before the game name, if any
+	while (*msg == ' ')
+		msg++;
+
+	Com_Printf (MSG_NORMAL, "> %s ---> getserversCount%s%s\n",
+				peer_address, (*msg != '\0') ? " for game " : "", msg);
+
+	memcpy (packet, header, sizeof (header) - 1);
+	packetind = sizeof (header) - 1;
+
+	populations = Sv_GetPopulations (&nb_populations);
+	for (ind = 0; ind < nb_populations; ind++)
+	{
+		const sv_population_t* population = &populations[ind];
+		int line_size;
+
+		if (population->gamename[0] == '\0' ||
+			(*msg != '\0' && strcmp (population->gamename, msg) != 0))
+			continue;
+
+		line_size = snprintf (&packet[packetind], sizeof (packet) - packetind, "%s %d %u %u %u\n",
+							  population->gamename, population->protocol,
+							  population->nb_by_state[sv_state_empty],
+							  population->nb_by_state[sv_state_occupied],
+							  population->nb_by_state[sv_state_full]);
+
+		// Stop there if the packet is full
+		if (line_size < 0 || (size_t)line_size >= sizeof (packet) - packetind)
+			break;
+		packetind += line_size;
+		nb_lines++;
+	}
+
+	if (! Out_SendTo (recv_socket, packet, packetind, addr, addrlen))
+		Com_Printf (MSG_WARNING, "> WARNING: can't send getserversCountResponse (outbound queue full)\n");
 	else
-		Com_Printf (MSG_NORMAL, "> %s <--- %sResponse (%u servers)\n",
-					peer_address, request_name, nb_servers);
+		Com_Printf (MSG_NORMAL, "> %s <--- getserversCountResponse (%u lines)\n",
+					peer_address, nb_lines);
+}
+
+
+/*
+====================
+CopyInfostring
+
+Copy a parsed infostring for the clients, without its "challenge" key. Return its
+length, or 0 if it's malformed or longer than MAX_INFOSTRING_LENGTH characters
+====================
+*/
+static size_t CopyInfostring (char* dest, const infostring_t* info)
+{
+	size_t length = 0;
+	unsigned int ind;
+
+	if (! info->is_valid || info->too_many_spans || info->spans_length > MAX_INFOSTRING_LENGTH)
+		return 0;
+
+	for (ind = 0; ind < info->nb_spans; ind++)
+	{
+		const info_slice_t* span = &info->spans[ind];
+
+		memcpy (&dest[length], span->start, span->length);
+		length += span->length;
+	}
+
+	return length;
 }
 
 
@@ -651,27 +2176,69 @@ static void HandleGetServers (const char* msg, const struct sockaddr_storage* ad
 ====================
 HandleInfoResponse
 
-Parse infoResponse messages
+Parse infoResponse messages. Servers on probation enter
+the server list only if their infoResponse is valid
 ====================
 */
-static void HandleInfoResponse (server_t* server, const char* msg)
+static void HandleInfoResponse (const char* msg, const struct sockaddr_storage* address, socklen_t addrlen,
+								server_t* sv_hint)
 {
+	server_t* server;
+	pending_server_t* pending = NULL;
+	const char* expected_challenge;
+	time_t challenge_timeout;
+	infostring_t info;
+	char value_buffer [MAX_INFO_VALUE_LENGTH + 1];
 	const char* value;
 	int new_protocol;
 	char new_gametype [GAMETYPE_LENGTH];
 	char* end_ptr;
 	unsigned int new_maxclients, new_clients;
+	server_state_t new_state;
+	qboolean is_new, has_changed;
+	sv_listing_t prev_listing;
+	char infostring [MAX_INFOSTRING_LENGTH];
+	size_t info_length;
+	char new_mapname [MAPNAME_LENGTH];
+
+	server = Sv_GetByAddrHint (sv_hint, address, addrlen, false);
+	if (server != NULL)
+	{
+		expected_challenge = server->challenge;
+		challenge_timeout = server->challenge_timeout;
+	}
+	else if (stateless_challenges)
+	{
+		expected_challenge = NULL;
+		challenge_timeout = crt_time;
+	}
+	else
+	{
+		pending = Sv_GetPending (address, addrlen, false);
+		if (pending == NULL)
+		{
+			Com_Printf (MSG_WARNING,
+						"> WARNING: infoResponse from unknown server %s\n",
+						peer_address);
+			return;
+		}
+		expected_challenge = pending->challenge;
+		challenge_timeout = pending->challenge_timeout;
+	}
 
 	// Check the challenge
-	if (!server->challenge_timeout || server->challenge_timeout < crt_time)
+	if (!challenge_timeout || challenge_timeout < crt_time)
 	{
 		Com_Printf (MSG_WARNING,
 					"> WARNING: infoResponse with obsolete challenge from %s\n",
 					peer_address);
 		return;
 	}
-	value = SearchInfostring (msg, "challenge");
-	if (!value || strcmp (value, server->challenge))
+	ParseInfostring (msg, &info);
+	value = GetInfoValue (&info, INFO_KEY_CHALLENGE, value_buffer, sizeof (value_buffer));
+	if (!value ||
+		(expected_challenge != NULL && strcmp (value, expected_challenge)) ||
+		(expected_challenge == NULL && ! IsValidStatelessChallenge (address, value)))
 	{
 		Com_Printf (MSG_WARNING, "> WARNING: invalid challenge from %s (%s)\n",
 					peer_address, value);
@@ -679,7 +2246,7 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 	}
 
 	// Check the value of "protocol"
- 	value = SearchInfostring (msg, "protocol");
+	value = GetInfoValue (&info, INFO_KEY_PROTOCOL, value_buffer, sizeof (value_buffer));
 	if (value == NULL)
 	{
 		Com_Printf (MSG_WARNING,
@@ -697,7 +2264,7 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 	}
 
 	// Check the value of "gametype"
- 	value = SearchInfostring (msg, "gametype");
+	value = GetInfoValue (&info, INFO_KEY_GAMETYPE, value_buffer, sizeof (value_buffer));
 	if (value != NULL)
 	{
 		if (strchr (value, ' ') != NULL)
@@ -717,7 +2284,7 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 
 
 	// Check the value of "maxclients"
-	value = SearchInfostring (msg, "sv_maxclients");
+	value = GetInfoValue (&info, INFO_KEY_MAXCLIENTS, value_buffer, sizeof (value_buffer));
 	new_maxclients = ((value != NULL) ? atoi (value) : 0);
 	if (new_maxclients == 0)
 	{
@@ -728,7 +2295,7 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 	}
 
 	// Check the presence of "clients"
-	value = SearchInfostring (msg, "clients");
+	value = GetInfoValue (&info, INFO_KEY_CLIENTS, value_buffer, sizeof (value_buffer));
 	if (value == NULL)
 	{
 		Com_Printf (MSG_WARNING,
@@ -739,7 +2306,7 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 	new_clients = ((value != NULL) ? atoi (value) : 0);
 
 	// Q3A doesn't send a gamename, so we add it manually
-	value = SearchInfostring (msg, "gamename");
+	value = GetInfoValue (&info, INFO_KEY_GAMENAME, value_buffer, sizeof (value_buffer));
 	if (value == NULL)
 		value = GAMENAME_EF2;
 	else if (value[0] == '\0')
@@ -756,6 +2323,13 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 					peer_address);
 		return;
 	}
+	else if (strlen (value) >= GAMENAME_LENGTH)
+	{
+		Com_Printf (MSG_WARNING,
+					"> WARNING: invalid infoResponse from %s (game name is too long)\n",
+					peer_address);
+		return;
+	}
 	
 	if (! Game_IsAccepted (value))
 	{
@@ -765,16 +2339,70 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 		return;
 	}
 
-	// Save some useful informations in the server entry
-	strncpy (server->gamename, value, sizeof (server->gamename) - 1);
-	server->protocol = new_protocol;
-	strncpy (server->gametype, new_gametype, sizeof (server->gametype) - 1);
+	// If the server was unknown, it has proved its identity: register it
+	if (server == NULL)
+	{
+		server = Sv_GetByAddr (address, addrlen, true);
+		if (server == NULL)
+			return;
+
+		if (pending != NULL)
+		{
+			strncpy (server->challenge, pending->challenge, sizeof (server->challenge) - 1);
+			server->challenge_timeout = pending->challenge_timeout;
+			Sv_RemovePending (pending);
+		}
+	}
+
 	if (new_clients == 0)
-		server->state = sv_state_empty;
+		new_state = sv_state_empty;
 	else if (new_clients == new_maxclients)
-		server->state = sv_state_full;
+		new_state = sv_state_full;
 	else
-		server->state = sv_state_occupied;
+		new_state = sv_state_occupied;
+
+	// Find out if clients will see a difference
+	is_new = (server->state == sv_state_uninitialized);
+	has_changed = (is_new || server->state != new_state ||
+				   server->protocol != new_protocol ||
+				   strcmp (server->gametype, new_gametype) != 0 ||
+				   strcmp (server->gamename, value) != 0);
+
+	// Save some useful informations in the server entry
+	Sv_GetListing (server, &prev_listing);
+	if (has_changed)
+		Sv_RemoveFromPopulations (server);
+	memcpy (server->gamename, value, strlen (value) + 1);
+	server->protocol = new_protocol;
+	strncpy (server->gametype, new_gametype, sizeof (server->gametype) - 1);
+	server->state = new_state;
+	if (is_new)
+	{
+		server->record_size = (qbyte)WriteServerRecord (server->record, &server->address,
+														server->addrmap, false);
+		server->binary_record_size = (qbyte)WriteServerRecord (server->binary_record, &server->address,
+															   server->addrmap, true);
+	}
+
+	// A server which couldn't be counted because all the populations were
+	// in use is counted as soon as one of them is available again
+	if (! server->in_population)
+		Sv_AddToPopulations (server);
+	if (has_changed)
+		Sv_LogChange (server, is_new ? sv_change_added : sv_change_updated, &prev_listing);
+
+	// Keep the fields clients can filter on
+	value = GetInfoValue (&info, INFO_KEY_MAPNAME, value_buffer, sizeof (value_buffer));
+	CopyLowercase (new_mapname, (value != NULL) ? value : "", sizeof (new_mapname));
+	Sv_SetMapname (server, new_mapname);
+	value = GetInfoValue (&info, INFO_KEY_HOSTNAME, value_buffer, sizeof (value_buffer));
+	CopyLowercase (server->hostname, (value != NULL) ? value : "", sizeof (server->hostname));
+	server->nb_clients = new_clients;
+
+	// Keep the infostring for the clients which ask for it
+	info_length = CopyInfostring (infostring, &info);
+	if (Sv_SetInfostring (server, infostring, info_length))
+		info_generation++;
 
 	// Set a new timeout
 	server->timeout = crt_time + TIMEOUT_INFORESPONSE;
@@ -783,7 +2411,133 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 
 // ---------- Public functions ---------- //
 
-extern server_t *servers;
+/*
+====================
+InitChallengeKey
+
+Pick the secret key of the stateless challenges. A guessable key would let
+anyone forge challenges, so we refuse to use a weak random source for it
+====================
+*/
+qboolean InitChallengeKey (void)
+{
+	if (! Sys_GetRandomBytes (challenge_key, sizeof (challenge_key)))
+	{
+		Com_Printf (MSG_ERROR,
+					"> ERROR: no strong random source available, can't use stateless challenges\n");
+		return false;
+	}
+
+	return true;
+}
+
+
+/*
+====================
+HandleQueuedQueries
+
+Answer the getservers requests received in the current batch of packets.
+Identical requests share the same prerendered response, so we filter the
+server list once for all of them
+====================
+*/
+void HandleQueuedQueries (void)
+{
+	unsigned int ind;
+
+	for (ind = 0; ind < nb_queued_queries; ind++)
+	{
+		const queued_query_t* request = &queued_queries[ind];
+
+		memcpy (peer_address, request->peer_address, sizeof (request->peer_address));
+		SendGetServersResponse (request);
+	}
+
+	nb_queued_queries = 0;
+}
+
+
+/*
+====================
+HasResponseJobs
+
+Check if some getservers responses are still being built or sent
+====================
+*/
+qboolean HasResponseJobs (void)
+{
+	return (nb_response_jobs > 0);
+}
+
+
+/*
+====================
+GetResponseJobsDelay
+
+Get the number of milliseconds before a response job can go on.
+When all the jobs are waiting for their pacing tokens, there's
+no need to wake up before the first of them gets one
+====================
+*/
+unsigned int GetResponseJobsDelay (void)
+{
+	unsigned int now = Sys_GetMilliseconds ();
+	unsigned int token_period;
+	unsigned int delay = UINT_MAX;
+	unsigned int ind;
+
+	if (pacing_rate == 0)
+		return 0;
+
+	// Rounded up, so that the job has its token when we wake up
+	token_period = (1000 + pacing_rate - 1) / pacing_rate;
+
+	for (ind = 0; ind < MAX_RESPONSE_JOBS; ind++)
+	{
+		response_job_t* job = &response_jobs[ind];
+		unsigned int elapsed;
+
+		if (! job->in_use)
+			continue;
+
+		RefillJobTokens (job, now);
+		if (job->entry->building || job->nb_tokens > 0)
+			return 0;
+
+		elapsed = now - job->token_time;
+		if (elapsed >= token_period)
+			return 0;
+		if (token_period - elapsed < delay)
+			delay = token_period - elapsed;
+	}
+
+	return delay;
+}
+
+
+/*
+====================
+AdvanceResponseJobs
+
+Build or send the next packets of each getservers response in progress
+====================
+*/
+void AdvanceResponseJobs (void)
+{
+	unsigned int ind;
+
+	for (ind = 0; ind < MAX_RESPONSE_JOBS; ind++)
+	{
+		response_job_t* job = &response_jobs[ind];
+
+		if (job->in_use && AdvanceResponseJob (job, true))
+		{
+			job->in_use = false;
+			nb_response_jobs--;
+		}
+	}
+}
+
 
 /*
 ====================
@@ -795,7 +2549,8 @@ Parse a packet to figure out what to do with it
 void HandleMessage (const char* msg, size_t length,
 					const struct sockaddr_storage* address,
 					socklen_t addrlen,
-					socket_t recv_socket)
+					socket_t recv_socket,
+					server_t* sv_hint)
 {
 	server_t* server;
 
@@ -807,43 +2562,62 @@ void HandleMessage (const char* msg, size_t length,
 		// Extract the game id
 		sscanf (msg + strlen (S2M_HEARTBEAT) + 1, "%63s", gameId);
 
-		// Check if this server goes down
-		if(!strncmp(gameId, "TikiServer-Flatline", 19)) {
-			server = Sv_GetByAddr(address, addrlen, false);
-			Sv_IsActive((unsigned int)(server - servers));
+		Com_Printf (MSG_NORMAL, "> %s ---> heartbeat (%s)\n",
+					peer_address, gameId);
+
+		// If this server is shutting down, stop sending it to clients right
+		// away instead of waiting for it to time out. Since the message may be
+		// spoofed, we ask the server for its infos: it's only removed if it
+		// doesn't answer. Servers on probation simply expire with their challenge
+		if (!strncmp (gameId, S2M_FLATLINE_GAMEID, strlen (S2M_FLATLINE_GAMEID)))
+		{
+			server = Sv_GetByAddrHint (sv_hint, address, addrlen, false);
+			if (server != NULL)
+			{
+				Sv_Hide (server, "is shutting down");
+				RenewChallenge (server->challenge, &server->challenge_timeout);
+				SendGetInfo (server->challenge, address, addrlen, recv_socket);
+			}
 			return;
 		}
 
+		// Ask for some infos. Unknown servers are put on probation until
+		// they answer, registered servers get a chance to update their state
+		server = Sv_GetByAddrHint (sv_hint, address, addrlen, false);
+		if (server != NULL)
+		{
+			assert (server->state != sv_state_unused_slot);
+			RenewChallenge (server->challenge, &server->challenge_timeout);
+			SendGetInfo (server->challenge, address, addrlen, recv_socket);
+		}
 
-		Com_Printf (MSG_NORMAL, "> %s ---> heartbeat (%s)\n",
-					peer_address, gameId);
+		// Stateless challenges don't need any memory until the server answers
+		else if (stateless_challenges)
+		{
+			const char* challenge;
 
-		// Get the server in the list (add it to the list if necessary)
-		server = Sv_GetByAddr (address, addrlen, true);
-		if (server == NULL)
-			return;
+			if (! Sv_IsAllowedAddress (address, NULL))
+				return;
 
-		assert (server->state != sv_state_unused_slot);
+			challenge = BuildStatelessChallenge (address, (unsigned int)(crt_time / TIMEOUT_CHALLENGE));
+			SendGetInfo (challenge, address, addrlen, recv_socket);
+		}
+		else
+		{
+			pending_server_t* pending = Sv_GetPending (address, addrlen, true);
 
-		// Ask for some infos
-		SendGetInfo (server, recv_socket);
+			if (pending == NULL)
+				return;
+			RenewChallenge (pending->challenge, &pending->challenge_timeout);
+			SendGetInfo (pending->challenge, address, addrlen, recv_socket);
+		}
 	}
 
 	// If it's an infoResponse message
 	else if (!strncmp (S2M_INFORESPONSE, msg, strlen (S2M_INFORESPONSE)))
 	{
 		Com_Printf (MSG_NORMAL, "> %s ---> infoResponse\n", peer_address);
-	
-		server = Sv_GetByAddr (address, addrlen, false);
-		if (server == NULL)
-		{
-			Com_Printf (MSG_WARNING,
-						"> WARNING: infoResponse from unknown server %s\n",
-						peer_address);
-			return;
-		}
-
-		HandleInfoResponse (server, msg + strlen (S2M_INFORESPONSE));
+		HandleInfoResponse (msg + strlen (S2M_INFORESPONSE), address, addrlen, sv_hint);
 	}
 
 	// If it's a getservers request
@@ -859,4 +2633,13 @@ void HandleMessage (const char* msg, size_t length,
 		HandleGetServers (msg + strlen (C2M_GETSERVERSEXT), address, addrlen,
 						  recv_socket, true);
 	}
+
+	// If it's a getserversCount request (the command may be the whole packet)
+	else if (!strncmp (C2M_GETSERVERSCOUNT, msg, strlen (C2M_GETSERVERSCOUNT)) &&
+			 (msg[strlen (C2M_GETSERVERSCOUNT)] == ' ' ||
+			  msg[strlen (C2M_GETSERVERSCOUNT)] == '\0'))
+	{
+		HandleGetServersCount (msg + strlen (C2M_GETSERVERSCOUNT), address, addrlen,
+							   recv_socket);
+	}
 }
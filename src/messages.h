@@ -26,13 +26,51 @@
 #define _MESSAGES_H_
 
 
+// ---------- Constants ---------- //
+
+// Default time window (in seconds) during which getservers retries are ignored
+#define DEFAULT_GETSERVERS_RETRY_WINDOW 1
+
+// Default rate (in packets per second) at which a getservers response is sent to a client
+#define DEFAULT_PACING_RATE 100
+
+
+// ---------- Public variables ---------- //
+
+// Do we use stateless challenges for the servers which aren't registered yet?
+extern qboolean stateless_challenges;
+
+// getservers requests repeated by a client within this number of seconds are ignored
+extern unsigned int getservers_retry_window;
+
+// Packets per second sent to each client for its getservers response (0 means no limit)
+extern unsigned int pacing_rate;
+
+
 // ---------- Public functions ---------- //
 
-// Parse a packet to figure out what to do with it
+// Pick the secret key of the stateless challenges (call it before the chroot).
+// Return false if there's no strong random source to pick it from
+qboolean InitChallengeKey (void);
+
+// Parse a packet to figure out what to do with it. "sv_hint" is the result of
+// the batched lookup of the sender (servers.h must be included before this file)
 void HandleMessage (const char* msg, size_t length,
 					const struct sockaddr_storage* address,
 					socklen_t addrlen,
-					socket_t recv_socket);
+					socket_t recv_socket,
+					server_t* sv_hint);
+
+// Answer the getservers requests received since the last call. Must be called
+// at the end of each batch of packets, since HandleMessage queues these requests
+void HandleQueuedQueries (void);
+
+// getservers responses are built and sent a few packets at a time. As long as
+// some are in progress, AdvanceResponseJobs must be called at each loop iteration,
+// but there's no need to call it before GetResponseJobsDelay milliseconds
+qboolean HasResponseJobs (void);
+unsigned int GetResponseJobsDelay (void);
+void AdvanceResponseJobs (void);
 
 
 #endif  // #ifndef _MESSAGES_H_
@@ -0,0 +1,494 @@
+/*
+	outgoing.c
+
+	Outgoing packets management for ef2master
+
+	Copyright (C) 2010  Walter Julius Hennecke
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+// sendmmsg() is a GNU extension
+#ifdef __linux__
+#	define _GNU_SOURCE
+#endif
+
+#include "common.h"
+#include "system.h"
+#include "outgoing.h"
+
+
+// ---------- Constants ---------- //
+
+// Can we send several packets with a single system call?
+#if defined (__linux__) && defined (MSG_WAITFORONE)
+#	define OUT_USE_SENDMMSG
+#endif
+
+
+// ---------- Types ---------- //
+
+// Packet waiting for the end of the current loop iteration
+typedef struct
+{
+	socket_t sock;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	size_t size;
+	qbyte data [MAX_PACKET_SIZE_OUT];
+} out_batched_packet_t;
+
+// Packet waiting to be sent
+typedef struct
+{
+	int next;				// next packet in the same queue, or in the free list
+	size_t size;
+	qbyte data [MAX_PACKET_SIZE_OUT];
+} out_packet_t;
+
+// Packets waiting to be sent to a given destination
+typedef struct
+{
+	qboolean in_use;
+	socket_t sock;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int first;				// packets are sent from the first one...
+	int last;				// ... and queued after the last one
+	unsigned int nb_packets;
+} out_queue_t;
+
+
+// ---------- Private variables ---------- //
+
+// Packets waiting to be sent, and the list of the free ones
+static out_packet_t packets [OUT_MAX_QUEUED_PACKETS];
+static int first_free_packet = -1;
+
+// Queues of the destinations
+static out_queue_t queues [OUT_MAX_QUEUES];
+static unsigned int nb_queues = 0;
+
+// Packets produced during the current loop iteration
+static out_batched_packet_t batch [OUT_BATCH_SIZE];
+static unsigned int nb_batched = 0;
+
+// Statistics
+static out_stats_t stats;
+
+
+// ---------- Private functions ---------- //
+
+/*
+====================
+Out_IsBusyError
+
+Check if the last network error only means the socket can't send anything for now
+====================
+*/
+static qboolean Out_IsBusyError (void)
+{
+	int error = Sys_GetLastNetError ();
+
+	return (error == NETERR_WOULDBLOCK || error == NETERR_NOBUFS);
+}
+
+
+/*
+====================
+Out_FindQueue
+
+Get the queue of a destination, or NULL if it has none
+====================
+*/
+static out_queue_t* Out_FindQueue (socket_t sock, const struct sockaddr_storage* addr, socklen_t addrlen)
+{
+	unsigned int ind;
+
+	for (ind = 0; ind < OUT_MAX_QUEUES; ind++)
+	{
+		out_queue_t* queue = &queues[ind];
+
+		if (queue->in_use && queue->sock == sock && queue->addrlen == addrlen &&
+			memcmp (&queue->addr, addr, addrlen) == 0)
+			return queue;
+	}
+
+	return NULL;
+}
+
+
+/*
+====================
+Out_Drop
+
+Count a packet which couldn't be queued
+====================
+*/
+static qboolean Out_Drop (void)
+{
+	stats.nb_dropped++;
+	return false;
+}
+
+
+/*
+====================
+Out_Enqueue
+
+Add a packet at the end of the queue of its destination (which is created
+if "queue" is NULL). Return false if the packet had to be dropped
+====================
+*/
+static qboolean Out_Enqueue (out_queue_t* queue, socket_t sock, const void* data, size_t size,
+							 const struct sockaddr_storage* addr, socklen_t addrlen)
+{
+	out_packet_t* packet;
+	int packet_ind;
+
+	assert (size <= sizeof (packets[0].data));
+
+	if (first_free_packet < 0 ||
+		(queue != NULL && queue->nb_packets >= OUT_MAX_PACKETS_PER_QUEUE))
+		return Out_Drop ();
+
+	if (queue == NULL)
+	{
+		unsigned int ind;
+
+		if (nb_queues >= OUT_MAX_QUEUES)
+			return Out_Drop ();
+
+		for (ind = 0; queues[ind].in_use; ind++)
+			;
+		queue = &queues[ind];
+		queue->in_use = true;
+		queue->sock = sock;
+		memcpy (&queue->addr, addr, addrlen);
+		queue->addrlen = addrlen;
+		queue->first = -1;
+		queue->last = -1;
+		queue->nb_packets = 0;
+		nb_queues++;
+	}
+
+	packet_ind = first_free_packet;
+	packet = &packets[packet_ind];
+	first_free_packet = packet->next;
+
+	memcpy (packet->data, data, size);
+	packet->size = size;
+	packet->next = -1;
+	if (queue->last < 0)
+		queue->first = packet_ind;
+	else
+		packets[queue->last].next = packet_ind;
+	queue->last = packet_ind;
+	queue->nb_packets++;
+
+	stats.nb_queued++;
+	if (stats.nb_queued > stats.max_queued)
+		stats.max_queued = stats.nb_queued;
+	return true;
+}
+
+
+/*
+====================
+Out_Queue
+
+Add a packet at the end of the queue of its destination
+====================
+*/
+static qboolean Out_Queue (socket_t sock, const void* data, size_t size,
+						   const struct sockaddr_storage* addr, socklen_t addrlen)
+{
+	out_queue_t* queue = NULL;
+
+	if (nb_queues > 0)
+		queue = Out_FindQueue (sock, addr, addrlen);
+	return Out_Enqueue (queue, sock, data, size, addr, addrlen);
+}
+
+
+/*
+====================
+Out_Dequeue
+
+Remove the first packet of a queue, and the queue itself if it's empty
+====================
+*/
+static void Out_Dequeue (out_queue_t* queue)
+{
+	int packet_ind = queue->first;
+
+	queue->first = packets[packet_ind].next;
+	packets[packet_ind].next = first_free_packet;
+	first_free_packet = packet_ind;
+
+	queue->nb_packets--;
+	stats.nb_queued--;
+
+	if (queue->nb_packets == 0)
+	{
+		queue->in_use = false;
+		nb_queues--;
+	}
+}
+
+
+/*
+====================
+Out_SendPackets
+
+Send some of the batched packets, all on the same socket. Return the number of
+packets sent, or -1 if the first one couldn't be sent (see the network error)
+====================
+*/
+static int Out_SendPackets (const out_batched_packet_t* packets_to_send, unsigned int nb_packets)
+{
+#ifdef OUT_USE_SENDMMSG
+	struct mmsghdr msgs [OUT_BATCH_SIZE];
+	struct iovec iovecs [OUT_BATCH_SIZE];
+	unsigned int ind;
+
+	assert (nb_packets <= OUT_BATCH_SIZE);
+
+	memset (msgs, 0, nb_packets * sizeof (msgs[0]));
+	for (ind = 0; ind < nb_packets; ind++)
+	{
+		const out_batched_packet_t* packet = &packets_to_send[ind];
+
+		iovecs[ind].iov_base = (void*)packet->data;
+		iovecs[ind].iov_len = packet->size;
+		msgs[ind].msg_hdr.msg_name = (void*)&packet->addr;
+		msgs[ind].msg_hdr.msg_namelen = packet->addrlen;
+		msgs[ind].msg_hdr.msg_iov = &iovecs[ind];
+		msgs[ind].msg_hdr.msg_iovlen = 1;
+	}
+
+	return sendmmsg (packets_to_send[0].sock, msgs, nb_packets, 0);
+#else
+	const out_batched_packet_t* packet = &packets_to_send[0];
+
+	if (sendto (packet->sock, (void*)packet->data, packet->size, 0,
+				(const struct sockaddr*)&packet->addr, packet->addrlen) < 0)
+		return -1;
+	return 1;
+#endif
+}
+
+
+/*
+====================
+Out_SendRun
+
+Send the batched packets from "first" to "last" (excluded), all on the same
+socket. If the socket gets busy, the remaining packets are queued
+====================
+*/
+static void Out_SendRun (unsigned int first, unsigned int last)
+{
+	unsigned int ind = first;
+
+	while (ind < last)
+	{
+		const out_batched_packet_t* packet = &batch[ind];
+		int nb_sent;
+
+		nb_sent = Out_SendPackets (packet, last - ind);
+		if (nb_sent > 0)
+		{
+			ind += nb_sent;
+			continue;
+		}
+
+		// If the socket is full, the rest will wait until it's writable
+		if (Out_IsBusyError ())
+		{
+			for (; ind < last; ind++)
+			{
+				packet = &batch[ind];
+				Out_Queue (packet->sock, packet->data, packet->size, &packet->addr, packet->addrlen);
+			}
+			return;
+		}
+
+		Com_Printf (MSG_WARNING, "> WARNING: can't send a packet to %s (%s)\n",
+					Sys_SockaddrToString (&packet->addr, packet->addrlen),
+					Sys_GetLastNetErrorString ());
+		ind++;
+	}
+}
+
+
+// ---------- Public functions ---------- //
+
+/*
+====================
+Out_Init
+
+Initialize the outbound queues
+====================
+*/
+void Out_Init (void)
+{
+	int packet_ind;
+
+	for (packet_ind = 0; packet_ind < OUT_MAX_QUEUED_PACKETS - 1; packet_ind++)
+		packets[packet_ind].next = packet_ind + 1;
+	packets[OUT_MAX_QUEUED_PACKETS - 1].next = -1;
+	first_free_packet = 0;
+}
+
+
+/*
+====================
+Out_SendTo
+
+Add a packet to the current batch, or to the queue of its destination if
+it already has packets waiting. Return false if the packet was dropped
+====================
+*/
+qboolean Out_SendTo (socket_t sock, const void* data, size_t size,
+					 const struct sockaddr_storage* addr, socklen_t addrlen)
+{
+	out_batched_packet_t* packet;
+
+	assert (size <= sizeof (batch[0].data));
+
+	if (nb_batched == OUT_BATCH_SIZE)
+		Out_FlushBatch ();
+
+	// Packets to a destination which already has some waiting must be sent after them
+	if (nb_queues > 0 && Out_FindQueue (sock, addr, addrlen) != NULL)
+		return Out_Queue (sock, data, size, addr, addrlen);
+
+	packet = &batch[nb_batched++];
+	packet->sock = sock;
+	memcpy (&packet->addr, addr, addrlen);
+	packet->addrlen = addrlen;
+	packet->size = size;
+	memcpy (packet->data, data, size);
+	return true;
+}
+
+
+/*
+====================
+Out_FlushBatch
+
+Send the packets of the current batch, with as few system calls as possible
+====================
+*/
+void Out_FlushBatch (void)
+{
+	unsigned int first = 0;
+
+	while (first < nb_batched)
+	{
+		socket_t sock = batch[first].sock;
+		unsigned int last = first + 1;
+
+		while (last < nb_batched && batch[last].sock == sock)
+			last++;
+
+		Out_SendRun (first, last);
+		first = last;
+	}
+
+	nb_batched = 0;
+}
+
+
+/*
+====================
+Out_HasQueuedPackets
+
+Are there packets waiting to be sent on this socket?
+====================
+*/
+qboolean Out_HasQueuedPackets (socket_t sock)
+{
+	unsigned int ind;
+
+	if (nb_queues == 0)
+		return false;
+
+	for (ind = 0; ind < OUT_MAX_QUEUES; ind++)
+		if (queues[ind].in_use && queues[ind].sock == sock)
+			return true;
+
+	return false;
+}
+
+
+/*
+====================
+Out_Flush
+
+Send the packets waiting on a socket, until it gets busy again.
+The queues take turns, one packet at a time, so a big response
+doesn't delay the packets to the other destinations
+====================
+*/
+void Out_Flush (socket_t sock)
+{
+	qboolean sent_some;
+
+	do
+	{
+		unsigned int ind;
+
+		sent_some = false;
+		for (ind = 0; ind < OUT_MAX_QUEUES && nb_queues > 0; ind++)
+		{
+			out_queue_t* queue = &queues[ind];
+			const out_packet_t* packet;
+
+			if (! queue->in_use || queue->sock != sock)
+				continue;
+
+			packet = &packets[queue->first];
+			if (sendto (sock, (void*)packet->data, packet->size, 0,
+						(const struct sockaddr*)&queue->addr, queue->addrlen) < 0)
+			{
+				if (Out_IsBusyError ())
+					return;
+
+				Com_Printf (MSG_WARNING, "> WARNING: can't send a queued packet to %s (%s)\n",
+							Sys_SockaddrToString (&queue->addr, queue->addrlen),
+							Sys_GetLastNetErrorString ());
+			}
+
+			Out_Dequeue (queue);
+			sent_some = true;
+		}
+	} while (sent_some);
+}
+
+
+/*
+====================
+Out_GetStats
+
+Get the statistics of the outbound queues
+====================
+*/
+const out_stats_t* Out_GetStats (void)
+{
+	return &stats;
+}
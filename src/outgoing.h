@@ -0,0 +1,83 @@
+/*
+	outgoing.h
+
+	Outgoing packets management for ef2master
+
+	Copyright (C) 2010  Walter Julius Hennecke
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef _OUTGOING_H_
+#define _OUTGOING_H_
+
+
+// ---------- Constants ---------- //
+
+// Max number of packets sent at the end of a loop iteration (beyond, they're sent earlier)
+#define OUT_BATCH_SIZE 64
+
+// Max number of packets waiting to be sent, for all destinations
+#define OUT_MAX_QUEUED_PACKETS 1024
+
+// Max number of destinations with packets waiting to be sent
+#define OUT_MAX_QUEUES 128
+
+// Max number of packets waiting to be sent to a given destination
+#define OUT_MAX_PACKETS_PER_QUEUE 256
+
+
+// ---------- Types ---------- //
+
+// Statistics of the outbound queues
+typedef struct
+{
+	unsigned int nb_queued;		// number of packets waiting to be sent
+	unsigned int max_queued;	// highest number of packets ever waiting
+	unsigned int nb_dropped;	// number of packets dropped because the queues were full
+} out_stats_t;
+
+
+// ---------- Public functions ---------- //
+
+// The packets produced during a loop iteration are batched, and sent together
+// at the end of the iteration. The listen sockets are non-blocking: when a
+// socket can't send a packet, the packet is put in the queue of its destination,
+// and the queues are emptied when the socket becomes writable again. Packets
+// to a given destination are always sent in order
+
+// Initialize the outbound queues
+void Out_Init (void);
+
+// Add a packet to the current batch (or queue it if its destination already
+// has packets waiting). Return false if the packet had to be dropped
+qboolean Out_SendTo (socket_t sock, const void* data, size_t size,
+					 const struct sockaddr_storage* addr, socklen_t addrlen);
+
+// Send the packets of the current batch. Must be called at the end of each loop iteration
+void Out_FlushBatch (void);
+
+// Are there packets waiting to be sent on this socket?
+qboolean Out_HasQueuedPackets (socket_t sock);
+
+// Send the packets waiting on a socket, until it gets busy again
+void Out_Flush (socket_t sock);
+
+// Get the statistics of the outbound queues
+const out_stats_t* Out_GetStats (void);
+
+
+#endif  // #ifndef _OUTGOING_H_
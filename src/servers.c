@@ -32,13 +32,32 @@
 // Timeout for a newly added server (in seconds)
 #define TIMEOUT_HEARTBEAT	2
 
+// Number of records in the change log (must be a power of 2)
+#define CHANGE_LOG_SIZE			4096
+
+// Number of buckets in the probation table (must be a power of 2),
+// and number of entries in each bucket
+#define PROBATION_NB_BUCKETS	256
+#define PROBATION_BUCKET_SIZE	4
+
+// Number of lists in the map index (must be a power of 2)
+#define MAP_INDEX_SIZE	256
+
+// Average space per server in the infostring arena
+#define INFOSTRING_ARENA_SPACE_PER_SERVER	256
+
+// Number of addresses a batched lookup handles at once, and how many
+// servers ahead of the one being resolved we prefetch
+#define LOOKUP_CHUNK_SIZE	64
+#define LOOKUP_PREFETCH_DISTANCE	4
+
 
 // ---------- Private variables ---------- //
 
 // All server structures are allocated in one block in the "servers" array.
 // Each used slot is also part of a linked list in "hash_table". A simple
 // hash of the address of a server gives its index in the table.
-server_t* servers = NULL;
+static server_t* servers = NULL;
 static unsigned int max_nb_servers = DEFAULT_MAX_NB_SERVERS;
 static unsigned int nb_servers = 0;
 static server_t** hash_table_ipv4 = NULL;
@@ -51,13 +70,37 @@ static unsigned int max_per_address = DEFAULT_MAX_NB_SERVERS_PER_ADDRESS;
 static int last_used_slot = -1;  // -1 = no used slot
 static int first_free_slot = 0;  // -1 = no more room
 
-// Variables for Sv_GetFirst, Sv_GetNext and Sv_Remove
-static int crt_server_ind = -1;
-static int last_server_ind = -1;
+// Number of servers ever added, and its value at the last batched lookup
+// (a server not found then can't have appeared since if it hasn't changed)
+static unsigned int nb_additions = 0;
+static unsigned int nb_additions_at_lookup = 0;
 
 // List of address mappings. They are sorted by "from" field (IP, then port)
 static addrmap_t* addrmaps = NULL;
 
+// Current generation of the server list, and change log
+static unsigned int generation = 0;
+static sv_change_t change_log [CHANGE_LOG_SIZE];
+
+// The probation table, for servers we haven't heard a valid infoResponse from yet
+static pending_server_t probation_table [PROBATION_NB_BUCKETS][PROBATION_BUCKET_SIZE];
+
+// Secret key of the probation table hash, so nobody can choose which bucket an address falls in
+static unsigned long long pending_key [2];
+
+// Populations of the server list
+static sv_population_t populations [MAX_NB_POPULATIONS];
+
+// The map index. Each entry is a list of the servers whose map name has this hash
+static server_t* map_index [MAP_INDEX_SIZE];
+
+// The infostring arena, and the spare one we use for compacting it
+static char* info_arena = NULL;
+static char* info_spare_arena = NULL;
+static size_t info_arena_size = 0;
+static size_t info_arena_used = 0;
+static size_t info_arena_dead = 0;	// bytes used by infostrings which have been freed or replaced
+
 
 // ---------- Public variables ---------- //
 
@@ -158,53 +201,6 @@ static void Sv_RemoveFromHashTable (server_t* sv)
 }
 
 
-/*
-====================
-Sv_Remove
-
-Remove a server from the lists
-====================
-*/
-static void Sv_Remove (server_t* sv)
-{
-	int sv_ind;
-
-	Sv_RemoveFromHashTable (sv);
-
-	// Mark this structure as "free"
-	sv->state = sv_state_unused_slot;
-
-	// Update first_free_slot if necessary
-	sv_ind = (int)(sv - servers);
-	assert (sv_ind >= 0);
-	assert (sv_ind <= last_used_slot);
-	if (first_free_slot == -1 || sv_ind < first_free_slot)
-		first_free_slot = sv_ind;
-
-	// If it was the last used slot, look for the previous one
-	if (last_used_slot == sv_ind)
-		do
-		{
-			last_used_slot--;
-		} while (last_used_slot >= 0 && servers[last_used_slot].state == sv_state_unused_slot);
-	
-	// If we have removed the end of the server iteration, set it to the new end of the list
-	if (last_server_ind > last_used_slot)
-		last_server_ind = last_used_slot;
-
-	// Same thing for the current iteration value
-	if (crt_server_ind > last_used_slot)
-		crt_server_ind = last_used_slot;
-
-	nb_servers--;
-	Com_Printf (MSG_NORMAL,
-				"> %s timed out; %u server(s) currently registered\n",
-				Sys_SockaddrToString(&sv->address, sv->addrlen), nb_servers);
-
-	assert (last_used_slot >= (int)nb_servers - 1);
-}
-
-
 /*
 ====================
 Sv_AllocateHashTable
@@ -217,10 +213,9 @@ static server_t** Sv_AllocateHashTable (size_t table_size, const char* proto_nam
 	server_t** result;
 	size_t array_size = table_size * sizeof (server_t*);
 
-	result = malloc (array_size);
+	result = Sys_AllocLargeBlock (array_size, "hash table");
 	if (result != NULL)
 	{
-		memset (result, 0, array_size);
 		Com_Printf (MSG_DEBUG,
 					"> %s hash table allocated (%u entries)\n",
 					proto_name, table_size);
@@ -242,7 +237,7 @@ Return true if a server is active.
 Test if the server has timed out and remove it if it's the case.
 ====================
 */
-qboolean Sv_IsActive (unsigned int sv_ind)
+static qboolean Sv_IsActive (unsigned int sv_ind)
 {
 	server_t* sv = &servers[sv_ind];
 	
@@ -257,7 +252,7 @@ qboolean Sv_IsActive (unsigned int sv_ind)
 	// If the server has timed out
 	if (sv->timeout < crt_time)
 	{
-		Sv_Remove (sv);
+		Sv_Remove (sv, "timed out");
 		return false;
 	}
 
@@ -396,22 +391,6 @@ static server_t* Sv_GetByAddr_Internal (const struct sockaddr_storage* address,
 }
 
 
-/*
-====================
-Sv_CheckTimeouts
-
-Browse the server list and remove all the servers that have timed out
-====================
-*/
-static void Sv_CheckTimeouts (void)
-{
-	int ind;
-	
-	for (ind = 0; ind <= last_used_slot; ind++)
-		Sv_IsActive (ind);
-}
-
-
 /*
 ====================
 Sv_ResolveIPv4Addr
@@ -613,6 +592,168 @@ static qboolean Sv_ResolveAddrmap (addrmap_t* addrmap)
 }
 
 
+/*
+====================
+Sv_PendingHash
+
+Compute the index of the probation table bucket for an address. It's a keyed
+hash (SipHash), otherwise spoofed heartbeats could be sent from addresses
+picked to fall in the bucket of a given server, and evict it
+====================
+*/
+static unsigned int Sv_PendingHash (const struct sockaddr_storage* address)
+{
+	qbyte msg [sizeof (struct in6_addr) + sizeof (unsigned short)];
+	size_t msglen;
+
+	if (address->ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)address;
+
+		memcpy (msg, &addr6->sin6_addr, sizeof (addr6->sin6_addr));
+		memcpy (&msg[sizeof (addr6->sin6_addr)], &addr6->sin6_port, sizeof (addr6->sin6_port));
+		msglen = sizeof (addr6->sin6_addr) + sizeof (addr6->sin6_port);
+	}
+	else
+	{
+		const struct sockaddr_in* addr4 = (const struct sockaddr_in*)address;
+
+		assert(address->ss_family == AF_INET);
+		memcpy (msg, &addr4->sin_addr, sizeof (addr4->sin_addr));
+		memcpy (&msg[sizeof (addr4->sin_addr)], &addr4->sin_port, sizeof (addr4->sin_port));
+		msglen = sizeof (addr4->sin_addr) + sizeof (addr4->sin_port);
+	}
+
+	return (unsigned int)Com_SipHash (pending_key, msg, msglen) & (PROBATION_NB_BUCKETS - 1);
+}
+
+
+/*
+====================
+Sv_IsSamePending
+
+Return true if a pending server is talking from this exact address
+====================
+*/
+static qboolean Sv_IsSamePending (const pending_server_t* pending, const struct sockaddr_storage* address)
+{
+	if (pending->address.v4.sin_family != address->ss_family)
+		return false;
+
+	if (address->ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)address;
+
+		return (pending->address.v6.sin6_port == addr6->sin6_port &&
+				pending->address.v6.sin6_scope_id == addr6->sin6_scope_id &&
+				memcmp (&pending->address.v6.sin6_addr.s6_addr, &addr6->sin6_addr.s6_addr,
+						sizeof (addr6->sin6_addr.s6_addr)) == 0);
+	}
+	else
+	{
+		const struct sockaddr_in* addr4 = (const struct sockaddr_in*)address;
+
+		return (pending->address.v4.sin_port == addr4->sin_port &&
+				pending->address.v4.sin_addr.s_addr == addr4->sin_addr.s_addr);
+	}
+}
+
+
+/*
+====================
+Sv_MapHash
+
+Compute the hash of a map name for the map index
+====================
+*/
+static unsigned int Sv_MapHash (const char* mapname)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*mapname != '\0')
+	{
+		hash ^= (qbyte)*mapname++;
+		hash *= 16777619;
+	}
+
+	return hash & (MAP_INDEX_SIZE - 1);
+}
+
+
+/*
+====================
+Sv_RemoveFromMapIndex
+
+Remove a server from the map index, if it's in there
+====================
+*/
+static void Sv_RemoveFromMapIndex (server_t* sv)
+{
+	if (sv->map_prev_ptr == NULL)
+		return;
+
+	*sv->map_prev_ptr = sv->map_next;
+	if (sv->map_next != NULL)
+		sv->map_next->map_prev_ptr = sv->map_prev_ptr;
+	sv->map_next = NULL;
+	sv->map_prev_ptr = NULL;
+}
+
+
+/*
+====================
+Sv_SkipToMap
+
+Return the first active server on a given map, starting at "sv"
+====================
+*/
+static const server_t* Sv_SkipToMap (const server_t* sv, const char* mapname)
+{
+	while (sv != NULL &&
+		   (sv->timeout < crt_time || strcmp (sv->mapname, mapname) != 0))
+		sv = sv->map_next;
+
+	return sv;
+}
+
+
+/*
+====================
+Sv_CompactInfostrings
+
+Move the infostrings of the active servers at the beginning of the spare
+arena, which then becomes the infostring arena. Freed and overwritten
+infostrings leave holes in the arena, so it needs to be done from time to time
+====================
+*/
+static void Sv_CompactInfostrings (void)
+{
+	char* old_arena = info_arena;
+	size_t new_used = 0;
+	int sv_ind;
+
+	for (sv_ind = 0; sv_ind <= last_used_slot; sv_ind++)
+	{
+		server_t* sv = &servers[sv_ind];
+
+		if (sv->state == sv_state_unused_slot || sv->info_length == 0)
+			continue;
+
+		memcpy (&info_spare_arena[new_used], &old_arena[sv->info_offset], sv->info_length);
+		sv->info_offset = (unsigned int)new_used;
+		new_used += sv->info_length;
+	}
+
+	Com_Printf (MSG_DEBUG, "> Infostring arena compacted (%u -> %u bytes used)\n",
+				(unsigned int)info_arena_used, (unsigned int)new_used);
+
+	info_arena = info_spare_arena;
+	info_spare_arena = old_arena;
+	info_arena_used = new_used;
+	info_arena_dead = 0;
+}
+
+
 // ---------- Public functions (servers) ---------- //
 
 /*
@@ -647,6 +788,16 @@ qboolean Sv_SetMaxNbServers (unsigned int nb)
 	if (servers != NULL || nb <= 0)
 		return false;
 
+	// Too big? The offsets in the infostring arena must fit in "info_offset"
+	// (and on 32-bit systems, the size of the servers array must fit in a size_t)
+	if (nb > UINT_MAX / INFOSTRING_ARENA_SPACE_PER_SERVER ||
+		(unsigned long long)nb * sizeof (servers[0]) > (size_t)-1)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: the maximum number of servers can't exceed %u\n",
+					UINT_MAX / INFOSTRING_ARENA_SPACE_PER_SERVER);
+		return false;
+	}
+
 	max_nb_servers = nb;
 	return true;
 }
@@ -682,9 +833,13 @@ qboolean Sv_Init (void)
 	unsigned int hash_table_size;
 	size_t array_size;
 
-	// Allocate "servers" and clean it
-	array_size = max_nb_servers * sizeof (servers[0]);
-	servers = malloc (array_size);
+	// Start from a random generation, so the generation numbers
+	// clients got from a previous run are very unlikely to be valid
+	generation = ((unsigned int)rand () << 16) ^ (unsigned int)rand ();
+
+	// Allocate "servers" (already cleaned)
+	array_size = (size_t)max_nb_servers * sizeof (servers[0]);
+	servers = Sys_AllocLargeBlock (array_size, "servers array");
 	if (!servers)
 	{
 		Com_Printf (MSG_ERROR,
@@ -692,7 +847,6 @@ qboolean Sv_Init (void)
 					  strerror (errno));
 		return false;
 	}
-	memset (servers, 0, array_size);
 	Com_Printf (MSG_NORMAL,
 				"> %u server records allocated (maximum number per address: ",
 				max_nb_servers);
@@ -701,7 +855,21 @@ qboolean Sv_Init (void)
 	else
 		Com_Printf (MSG_NORMAL, "%u)\n", max_per_address);
 
-	// Allocate the hash tables and clean them
+	// Allocate the infostring arenas
+	info_arena_size = (size_t)max_nb_servers * INFOSTRING_ARENA_SPACE_PER_SERVER;
+	if (info_arena_size < MAX_INFOSTRING_LENGTH)
+		info_arena_size = MAX_INFOSTRING_LENGTH;
+	info_arena = Sys_AllocLargeBlock (info_arena_size, "infostring arena");
+	info_spare_arena = Sys_AllocLargeBlock (info_arena_size, "spare infostring arena");
+	if (info_arena == NULL || info_spare_arena == NULL)
+	{
+		Com_Printf (MSG_ERROR,
+					"> ERROR: can't allocate the infostring arenas (%s)\n",
+					  strerror (errno));
+		return false;
+	}
+
+	// Allocate the hash tables (already cleaned)
 	hash_table_size = (1 << hash_size);
 	if (Sys_IsListeningOn (AF_INET))
 	{
@@ -722,38 +890,21 @@ qboolean Sv_Init (void)
 
 /*
 ====================
-Sv_GetByAddr
+Sv_IsAllowedAddress
 
-Search for a particular server in the list; add it if necessary
+Check if a server is allowed to talk from this address, and get its address
+mapping if "addrmap_ptr" isn't NULL
 ====================
 */
-server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrlen, qboolean add_it)
+qboolean Sv_IsAllowedAddress (const struct sockaddr_storage* address, const addrmap_t** addrmap_ptr)
 {
-	unsigned int nb_same_address = 0;
-	server_t *sv;
 	const addrmap_t* addrmap = NULL;
-	unsigned int hash;
-	unsigned int ind;
-	server_t** hash_table;
-
-	sv = Sv_GetByAddr_Internal (address, &nb_same_address);
-	if (sv != NULL)
-	{
-		assert (addrlen == sv->addrlen);
-		return sv;
-	}
-
-	if (! add_it)
-		return NULL;
 
-	assert (nb_same_address <= max_per_address || max_per_address == 0);
-	if (nb_same_address >= max_per_address && max_per_address != 0)
-	{
-		Com_Printf (MSG_WARNING,
-					"> WARNING: server %s isn't allowed (max number of servers reached for this address)\n",
-					peer_address);
-		return NULL;
-	}
+	// Address mappings are only available for IPv4 addresses
+	if (address->ss_family == AF_INET)
+		addrmap = Sv_GetAddrmap ((const struct sockaddr_in*)address);
+	if (addrmap_ptr != NULL)
+		*addrmap_ptr = addrmap;
 
 	if (! allow_loopback)
 	{
@@ -761,14 +912,13 @@ server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrle
 		if (address->ss_family == AF_INET)
 		{
 			const struct sockaddr_in* addr_in = (const struct sockaddr_in*)address;
-			addrmap = Sv_GetAddrmap (addr_in);
 			if ((ntohl (addr_in->sin_addr.s_addr) >> 24) == 127 &&
 				addrmap == NULL)
 			{
 				Com_Printf (MSG_WARNING,
 							"> WARNING: server %s isn't allowed (loopback address without address mapping)\n",
 							peer_address);
-				return NULL;
+				return false;
 			}
 		}
 		else
@@ -784,11 +934,52 @@ server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrle
 				Com_Printf (MSG_WARNING,
 							"> WARNING: server %s isn't allowed (IPv6 loopback address)\n",
 							peer_address);
-				return NULL;
+				return false;
 			}
 		}
 	}
 
+	return true;
+}
+
+
+/*
+====================
+Sv_GetByAddr
+
+Search for a particular server in the list; add it if necessary
+====================
+*/
+server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrlen, qboolean add_it)
+{
+	unsigned int nb_same_address = 0;
+	server_t *sv;
+	const addrmap_t* addrmap = NULL;
+	unsigned int hash;
+	unsigned int ind;
+	server_t** hash_table;
+
+	sv = Sv_GetByAddr_Internal (address, &nb_same_address);
+	if (sv != NULL)
+	{
+		assert (addrlen == sv->addrlen);
+		return sv;
+	}
+
+	if (! add_it)
+		return NULL;
+
+	assert (nb_same_address <= max_per_address || max_per_address == 0);
+	if (nb_same_address >= max_per_address && max_per_address != 0)
+	{
+		Com_Printf (MSG_WARNING,
+					"> WARNING: server %s isn't allowed (max number of servers reached for this address)\n",
+					peer_address);
+		return NULL;
+	}
+
+	if (! Sv_IsAllowedAddress (address, &addrmap))
+		return NULL;
 
 	// If the list is full, check the entries to see if we can free a slot
 	if (nb_servers == max_nb_servers)
@@ -846,6 +1037,7 @@ server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrle
 	sv->timeout = crt_time + TIMEOUT_HEARTBEAT;
 
 	nb_servers++;
+	nb_additions++;
 
 	Com_Printf (MSG_NORMAL,
 				"> New server added: %s. %u server(s) now registered, including %u for this address quota\n",
@@ -861,57 +1053,288 @@ server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrle
 
 /*
 ====================
-Sv_GetFirst
+Sv_GetByAddrBatch
 
-Get the first server in the list
+Search for several servers at once, without adding them. All the addresses
+are hashed first and their buckets prefetched, then the first server of each
+bucket is prefetched a few lookups ahead of the one being resolved, so the
+cache misses of the lookups overlap instead of adding up
 ====================
 */
-server_t* Sv_GetFirst (void)
+void Sv_GetByAddrBatch (const struct sockaddr_storage* addresses, unsigned int nb_addresses, server_t** results)
 {
-	if (nb_servers <= 0)
-		return NULL;
+	server_t** buckets [LOOKUP_CHUNK_SIZE];
 
-	// Pick the start of the iteration at random
-	crt_server_ind = rand () % (last_used_slot + 1);
+	nb_additions_at_lookup = nb_additions;
 
-	// Set the end of the iteration 
-	if (crt_server_ind == 0)
-		last_server_ind = last_used_slot;
-	else
-		last_server_ind = crt_server_ind - 1;
+	while (nb_addresses > 0)
+	{
+		unsigned int nb_lookups = nb_addresses;
+		unsigned int ind;
+
+		if (nb_lookups > LOOKUP_CHUNK_SIZE)
+			nb_lookups = LOOKUP_CHUNK_SIZE;
+
+		for (ind = 0; ind < nb_lookups; ind++)
+		{
+			const struct sockaddr_storage* address = &addresses[ind];
+			server_t** hash_table;
+
+			if (address->ss_family == AF_INET6)
+				hash_table = hash_table_ipv6;
+			else
+				hash_table = hash_table_ipv4;
+
+			buckets[ind] = &hash_table[Sv_AddressHash (address)];
+			PREFETCH (buckets[ind]);
+		}
+
+		for (ind = 0; ind < nb_lookups + LOOKUP_PREFETCH_DISTANCE; ind++)
+		{
+			if (ind < nb_lookups)
+			{
+				const server_t* sv = *buckets[ind];
+
+				if (sv != NULL)
+				{
+					PREFETCH (sv);
+					PREFETCH (&sv->state);
+				}
+			}
+
+			if (ind >= LOOKUP_PREFETCH_DISTANCE)
+			{
+				unsigned int res_ind = ind - LOOKUP_PREFETCH_DISTANCE;
+				unsigned int nb_same_address;
 
-	// If this first server is active, returns it
-	if (Sv_IsActive(crt_server_ind))
-		return &servers[crt_server_ind];
+				results[res_ind] = Sv_GetByAddr_Internal (&addresses[res_ind], &nb_same_address);
+			}
+		}
 
-	// Else, go on with the iteration
-	return Sv_GetNext ();
+		addresses += nb_lookups;
+		results += nb_lookups;
+		nb_addresses -= nb_lookups;
+	}
 }
 
 
 /*
 ====================
-Sv_GetNext
+Sv_GetByAddrHint
 
-Get the next server in the list
+Search for a server, using the result of the last batched lookup
+if it's still valid; add the server if necessary
 ====================
 */
-server_t* Sv_GetNext (void)
+server_t* Sv_GetByAddrHint (server_t* hint, const struct sockaddr_storage* address,
+							socklen_t addrlen, qboolean add_it)
 {
-	assert(last_used_slot >= -1);
-	assert(last_used_slot < (int)max_nb_servers);
-
-	while (crt_server_ind != last_server_ind)
+	// A server which wasn't found can only have been added since
+	if (hint == NULL)
 	{
-		crt_server_ind = (crt_server_ind + 1) % (last_used_slot + 1);
-		if (Sv_IsActive(crt_server_ind))
-			return &servers[crt_server_ind];
+		if (! add_it && nb_additions == nb_additions_at_lookup)
+			return NULL;
+	}
+
+	// A server which was found may have been removed since, and its slot reused
+	else if (hint->state != sv_state_unused_slot && hint->addrlen == addrlen)
+	{
+		qboolean same_public_address;
+		qboolean same_address;
+
+		if (address->ss_family == AF_INET6)
+			same_address = Sv_SameIPv6Addr (&hint->address, address, &same_public_address);
+		else
+			same_address = Sv_SameIPv4Addr (&hint->address, address, &same_public_address);
+		if (same_address)
+			return hint;
+	}
+
+	return Sv_GetByAddr (address, addrlen, add_it);
+}
+
+
+/*
+====================
+Sv_Remove
+
+Remove a server from the lists
+====================
+*/
+void Sv_Remove (server_t* sv, const char* reason)
+{
+	int sv_ind;
+
+	// Clients have never heard of uninitialized servers
+	if (sv->state > sv_state_uninitialized)
+	{
+		sv_listing_t listing;
+
+		Sv_GetListing (sv, &listing);
+		Sv_LogChange (sv, sv_change_removed, &listing);
+	}
+
+	Sv_RemoveFromHashTable (sv);
+	Sv_RemoveFromMapIndex (sv);
+	Sv_RemoveFromPopulations (sv);
+	info_arena_dead += sv->info_length;
+
+	// Mark this structure as "free"
+	sv->state = sv_state_unused_slot;
+
+	// Update first_free_slot if necessary
+	sv_ind = (int)(sv - servers);
+	assert (sv_ind >= 0);
+	assert (sv_ind <= last_used_slot);
+	if (first_free_slot == -1 || sv_ind < first_free_slot)
+		first_free_slot = sv_ind;
+
+	// If it was the last used slot, look for the previous one
+	if (last_used_slot == sv_ind)
+		do
+		{
+			last_used_slot--;
+		} while (last_used_slot >= 0 && servers[last_used_slot].state == sv_state_unused_slot);
+	
+	nb_servers--;
+	Com_Printf (MSG_NORMAL,
+				"> %s %s; %u server(s) currently registered\n",
+				Sys_SockaddrToString(&sv->address, sv->addrlen), reason, nb_servers);
+
+	assert (last_used_slot >= (int)nb_servers - 1);
+}
+
+
+/*
+====================
+Sv_Hide
+
+Stop sending a server to the clients until it sends a valid infoResponse
+again. It goes back to the state of a server which has just sent its first
+heartbeat, so it times out and is removed if it doesn't answer in time
+====================
+*/
+void Sv_Hide (server_t* sv, const char* reason)
+{
+	if (sv->state > sv_state_uninitialized)
+	{
+		sv_listing_t listing;
+
+		Sv_GetListing (sv, &listing);
+		Sv_LogChange (sv, sv_change_removed, &listing);
+		Sv_RemoveFromPopulations (sv);
+		sv->state = sv_state_uninitialized;
+	}
+
+	if (sv->timeout > crt_time + TIMEOUT_HEARTBEAT)
+		sv->timeout = crt_time + TIMEOUT_HEARTBEAT;
+
+	Com_Printf (MSG_NORMAL, "> %s %s; hidden until it answers\n",
+				Sys_SockaddrToString (&sv->address, sv->addrlen), reason);
+}
+
+
+/*
+====================
+Sv_GetFirst
+
+Get the first active server in the list
+====================
+*/
+const server_t* Sv_GetFirst (sv_iterator_t* iter)
+{
+	if (nb_servers <= 0)
+	{
+		iter->nb_left = 0;
+		return NULL;
+	}
+
+	// Pick the start of the iteration at random
+	iter->nb_slots = (unsigned int)(last_used_slot + 1);
+	iter->crt_ind = rand () % iter->nb_slots;
+	iter->nb_left = iter->nb_slots;
+
+	return Sv_GetNext (iter);
+}
+
+
+/*
+====================
+Sv_GetNext
+
+Get the next active server in the list
+====================
+*/
+const server_t* Sv_GetNext (sv_iterator_t* iter)
+{
+	while (iter->nb_left > 0)
+	{
+		const server_t* sv = &servers[iter->crt_ind];
+
+		iter->crt_ind = (iter->crt_ind + 1) % iter->nb_slots;
+		iter->nb_left--;
+
+		// Slots may have been freed since the start of the iteration,
+		// and timed out servers are left for the writer to remove
+		if (sv->state != sv_state_unused_slot && sv->timeout >= crt_time)
+			return sv;
 	}
 
 	return NULL;
 }
 
 
+/*
+====================
+Sv_GetByIndex
+
+Get the active server in a given slot, or NULL if there's none
+====================
+*/
+const server_t* Sv_GetByIndex (unsigned int sv_ind)
+{
+	const server_t* sv;
+
+	if (sv_ind >= max_nb_servers)
+		return NULL;
+
+	sv = &servers[sv_ind];
+	if (sv->state == sv_state_unused_slot || sv->timeout < crt_time)
+		return NULL;
+
+	return sv;
+}
+
+
+/*
+====================
+Sv_GetNbSlots
+
+Get the number of slots to look at for browsing the list with Sv_GetByIndex
+====================
+*/
+unsigned int Sv_GetNbSlots (void)
+{
+	return (unsigned int)(last_used_slot + 1);
+}
+
+
+/*
+====================
+Sv_CheckTimeouts
+
+Browse the server list and remove all the servers that have timed out
+====================
+*/
+void Sv_CheckTimeouts (void)
+{
+	int ind;
+	
+	for (ind = 0; ind <= last_used_slot; ind++)
+		Sv_IsActive (ind);
+}
+
+
 /*
 ====================
 Sv_PrintServerList
@@ -923,8 +1346,8 @@ void Sv_PrintServerList (msg_level_t msg_level)
 {
 	int ind;
 
-	Com_Printf (msg_level, "\n> %u servers registered (time: %lu):\n",
-				nb_servers, (unsigned long)crt_time);
+	Com_Printf (msg_level, "\n> %u servers registered (time: %lu, generation: %u):\n",
+				nb_servers, (unsigned long)crt_time, generation);
 
 	for (ind = 0; ind <= last_used_slot; ind++)
 		if (Sv_IsActive(ind))
@@ -975,6 +1398,398 @@ void Sv_PrintServerList (msg_level_t msg_level)
 }
 
 
+// ---------- Public functions (change log) ---------- //
+
+/*
+====================
+Sv_GetListing
+
+Get how a server is listed right now
+====================
+*/
+void Sv_GetListing (const server_t* sv, sv_listing_t* listing)
+{
+	listing->state = (sv->state > sv_state_uninitialized ? sv->state : sv_state_uninitialized);
+	listing->protocol = sv->protocol;
+	memcpy (listing->gametype, sv->gametype, sizeof (listing->gametype));
+	memcpy (listing->gamename, sv->gamename, sizeof (listing->gamename));
+}
+
+
+/*
+====================
+Sv_LogChange
+
+Record a change of a server, given how it was listed before the change
+====================
+*/
+void Sv_LogChange (const server_t* sv, sv_change_type_t type, const sv_listing_t* prev_listing)
+{
+	sv_change_t* change;
+
+	generation++;
+	change = &change_log[generation & (CHANGE_LOG_SIZE - 1)];
+
+	change->generation = generation;
+	change->sv_ind = (unsigned int)(sv - servers);
+	change->type = type;
+	change->addrlen = sv->addrlen;
+	memcpy (&change->address, &sv->address, sv->addrlen);
+	change->record_size = sv->record_size;
+	memcpy (change->record, sv->record, sv->record_size);
+	change->binary_record_size = sv->binary_record_size;
+	memcpy (change->binary_record, sv->binary_record, sv->binary_record_size);
+	change->prev_listing = *prev_listing;
+
+	Com_Printf (MSG_DEBUG, "  - generation %u: server %s\n", generation,
+				(type == sv_change_added ? "added" :
+				 (type == sv_change_updated ? "updated" : "removed")));
+}
+
+
+/*
+====================
+Sv_GetGeneration
+
+Get the current generation of the server list
+====================
+*/
+unsigned int Sv_GetGeneration (void)
+{
+	return generation;
+}
+
+
+/*
+====================
+Sv_GetChange
+
+Get the change which produced a given generation,
+or NULL if it isn't in the change log (anymore)
+====================
+*/
+const sv_change_t* Sv_GetChange (unsigned int change_gen)
+{
+	const sv_change_t* change = &change_log[change_gen & (CHANGE_LOG_SIZE - 1)];
+
+	// Generation numbers wrap around, so only their difference matters
+	if (generation - change_gen >= CHANGE_LOG_SIZE ||
+		change->generation != change_gen)
+		return NULL;
+
+	return change;
+}
+
+
+// ---------- Public functions (probation table) ---------- //
+
+/*
+====================
+Sv_InitPendingKey
+
+Pick the secret key of the probation table hash
+====================
+*/
+void Sv_InitPendingKey (void)
+{
+	if (! Sys_GetRandomBytes (pending_key, sizeof (pending_key)))
+		Com_Printf (MSG_WARNING,
+					"> WARNING: no strong random source available, the probation table is easier to flood\n");
+}
+
+
+/*
+====================
+Sv_GetPending
+
+Search for a pending server in the probation table; add it if necessary
+====================
+*/
+pending_server_t* Sv_GetPending (const struct sockaddr_storage* address, socklen_t addrlen, qboolean add_it)
+{
+	pending_server_t* bucket = probation_table[Sv_PendingHash (address)];
+	pending_server_t* oldest = &bucket[0];
+	const addrmap_t* addrmap;
+	unsigned int ind;
+
+	for (ind = 0; ind < PROBATION_BUCKET_SIZE; ind++)
+	{
+		pending_server_t* pending = &bucket[ind];
+
+		if (pending->challenge_timeout >= crt_time &&
+			Sv_IsSamePending (pending, address))
+			return pending;
+
+		if (pending->challenge_timeout < oldest->challenge_timeout)
+			oldest = pending;
+	}
+
+	if (! add_it || ! Sv_IsAllowedAddress (address, &addrmap))
+		return NULL;
+
+	// Recycle the oldest entry of the bucket. If it's still waiting for its
+	// infoResponse, the new server is the one which has to wait: it will
+	// try again with its next heartbeat
+	if (oldest->challenge_timeout >= crt_time)
+	{
+		Com_Printf (MSG_DEBUG,
+					"> Probation table bucket full, ignoring %s\n",
+					peer_address);
+		return NULL;
+	}
+
+	assert (addrlen <= sizeof (oldest->address));
+	memset (oldest, 0, sizeof (*oldest));
+	memcpy (&oldest->address, address, addrlen);
+	oldest->addrlen = addrlen;
+
+	Com_Printf (MSG_DEBUG, "> Server %s put on probation\n", peer_address);
+	return oldest;
+}
+
+
+/*
+====================
+Sv_RemovePending
+
+Remove a server from the probation table
+====================
+*/
+void Sv_RemovePending (pending_server_t* pending)
+{
+	memset (pending, 0, sizeof (*pending));
+}
+
+
+// ---------- Public functions (populations) ---------- //
+
+/*
+====================
+Sv_AddToPopulations
+
+Count a server in the population of its game name and protocol
+====================
+*/
+void Sv_AddToPopulations (server_t* sv)
+{
+	sv_population_t* free_population = NULL;
+	sv_population_t* population = NULL;
+	unsigned int ind;
+
+	assert (! sv->in_population);
+	assert (sv->state > sv_state_uninitialized);
+
+	for (ind = 0; ind < MAX_NB_POPULATIONS; ind++)
+	{
+		sv_population_t* crt_population = &populations[ind];
+
+		if (crt_population->gamename[0] == '\0')
+		{
+			if (free_population == NULL)
+				free_population = crt_population;
+		}
+		else if (crt_population->protocol == sv->protocol &&
+				 strcmp (crt_population->gamename, sv->gamename) == 0)
+		{
+			population = crt_population;
+			break;
+		}
+	}
+
+	if (population == NULL)
+	{
+		// Too many different games and protocols: this one won't be counted
+		if (free_population == NULL)
+			return;
+
+		population = free_population;
+		memset (population, 0, sizeof (*population));
+		memcpy (population->gamename, sv->gamename, sizeof (population->gamename));
+		population->protocol = sv->protocol;
+	}
+
+	population->nb_servers++;
+	population->nb_by_state[sv->state]++;
+	sv->in_population = true;
+}
+
+
+/*
+====================
+Sv_RemoveFromPopulations
+
+Stop counting a server (does nothing if it isn't counted)
+====================
+*/
+void Sv_RemoveFromPopulations (server_t* sv)
+{
+	unsigned int ind;
+
+	if (! sv->in_population)
+		return;
+
+	for (ind = 0; ind < MAX_NB_POPULATIONS; ind++)
+	{
+		sv_population_t* population = &populations[ind];
+
+		if (population->gamename[0] != '\0' &&
+			population->protocol == sv->protocol &&
+			strcmp (population->gamename, sv->gamename) == 0)
+		{
+			assert (population->nb_by_state[sv->state] > 0);
+			population->nb_by_state[sv->state]--;
+
+			// Free the population when its last server leaves
+			population->nb_servers--;
+			if (population->nb_servers == 0)
+				population->gamename[0] = '\0';
+			break;
+		}
+	}
+
+	sv->in_population = false;
+}
+
+
+/*
+====================
+Sv_GetPopulations
+
+Get the populations (unused ones have an empty game name)
+====================
+*/
+const sv_population_t* Sv_GetPopulations (unsigned int* nb_populations)
+{
+	*nb_populations = MAX_NB_POPULATIONS;
+	return populations;
+}
+
+
+// ---------- Public functions (map index) ---------- //
+
+/*
+====================
+Sv_SetMapname
+
+Set the map name of a server, and move it in the index if necessary
+====================
+*/
+void Sv_SetMapname (server_t* sv, const char* mapname)
+{
+	server_t** list;
+
+	if (sv->map_prev_ptr != NULL && strcmp (sv->mapname, mapname) == 0)
+		return;
+
+	Sv_RemoveFromMapIndex (sv);
+	strncpy (sv->mapname, mapname, sizeof (sv->mapname) - 1);
+	sv->mapname[sizeof (sv->mapname) - 1] = '\0';
+
+	list = &map_index[Sv_MapHash (sv->mapname)];
+	sv->map_next = *list;
+	sv->map_prev_ptr = list;
+	*list = sv;
+	if (sv->map_next != NULL)
+		sv->map_next->map_prev_ptr = &sv->map_next;
+}
+
+
+/*
+====================
+Sv_GetFirstOnMap
+
+Get the first active server on a given map
+====================
+*/
+const server_t* Sv_GetFirstOnMap (const char* mapname)
+{
+	return Sv_SkipToMap (map_index[Sv_MapHash (mapname)], mapname);
+}
+
+
+/*
+====================
+Sv_GetNextOnMap
+
+Get the next active server on the same map
+====================
+*/
+const server_t* Sv_GetNextOnMap (const server_t* sv)
+{
+	return Sv_SkipToMap (sv->map_next, sv->mapname);
+}
+
+
+// ---------- Public functions (infostrings) ---------- //
+
+/*
+====================
+Sv_SetInfostring
+
+Store the infostring of a server. Return true if it has changed
+====================
+*/
+qboolean Sv_SetInfostring (server_t* sv, const char* infostring, size_t length)
+{
+	assert (length <= MAX_INFOSTRING_LENGTH);
+
+	if (length == sv->info_length &&
+		memcmp (&info_arena[sv->info_offset], infostring, length) == 0)
+		return false;
+
+	// If it isn't longer than the previous one, just overwrite it
+	if (length <= sv->info_length)
+	{
+		memcpy (&info_arena[sv->info_offset], infostring, length);
+		info_arena_dead += sv->info_length - length;
+		sv->info_length = (unsigned short)length;
+		return true;
+	}
+
+	// Otherwise, append it to the arena. Compacting it copies all the live
+	// infostrings, so we only do it if it frees at least a quarter of the
+	// arena, and enough room for this infostring. That way, the copies cost
+	// at most 4 bytes per byte appended since the last compaction. If the
+	// arena is that full of live infostrings, we just drop this one
+	info_arena_dead += sv->info_length;
+	sv->info_length = 0;
+	if (info_arena_used + length > info_arena_size)
+	{
+		if (info_arena_dead >= info_arena_size / 4 &&
+			info_arena_used - info_arena_dead + length <= info_arena_size)
+			Sv_CompactInfostrings ();
+
+		if (info_arena_used + length > info_arena_size)
+		{
+			Com_Printf (MSG_WARNING,
+						"> WARNING: no room left for the infostring of %s\n",
+						Sys_SockaddrToString (&sv->address, sv->addrlen));
+			return true;
+		}
+	}
+
+	memcpy (&info_arena[info_arena_used], infostring, length);
+	sv->info_offset = (unsigned int)info_arena_used;
+	sv->info_length = (unsigned short)length;
+	info_arena_used += length;
+	return true;
+}
+
+
+/*
+====================
+Sv_GetInfostring
+
+Get the infostring of a server (not '\0'-terminated) and its length
+====================
+*/
+const char* Sv_GetInfostring (const server_t* sv, size_t* length)
+{
+	*length = sv->info_length;
+	return &info_arena[sv->info_offset];
+}
+
+
 // ---------- Public functions (address mappings) ---------- //
 
 /*
@@ -48,6 +48,19 @@
 // Max number of characters for a gametype, including the '\0'
 #define GAMETYPE_LENGTH 32
 
+// Max number of (game name, protocol) pairs we count the servers of
+#define MAX_NB_POPULATIONS 32
+
+// Max number of characters for a map name and a host name, including the '\0'
+#define MAPNAME_LENGTH 64
+#define HOSTNAME_LENGTH 64
+
+// Max size of a server record in a getservers response ('/' + IPv6 address + port)
+#define MAX_RECORD_SIZE (1 + 16 + 2)
+
+// Max number of characters in a stored infostring (without a '\0')
+#define MAX_INFOSTRING_LENGTH 1024
+
 
 // ---------- Types ---------- //
 
@@ -86,8 +99,90 @@ typedef struct server_s
 	char challenge [CHALLENGE_MAX_LENGTH];
 	char gametype [GAMETYPE_LENGTH];
 	char gamename [GAMENAME_LENGTH];
+	qbyte record_size;
+	qbyte binary_record_size;
+	qbyte record [MAX_RECORD_SIZE];	// encoded once, when the server enters the list
+	qbyte binary_record [MAX_RECORD_SIZE];
+	unsigned short info_length;		// the infostring is stored in the infostring arena
+	unsigned int info_offset;
+
+	// Fields clients can filter on (names are in lowercase)
+	struct server_s* map_next;		// servers on the same map (or with the same hash)
+	struct server_s** map_prev_ptr;	// NULL if the server isn't in the map index
+	unsigned int nb_clients;
+	char mapname [MAPNAME_LENGTH];
+	char hostname [HOSTNAME_LENGTH];
+
+	qboolean in_population;			// is the server counted in a population?
 } server_t;
 
+// Number of servers for a given game name and protocol, by state
+typedef struct
+{
+	char gamename [GAMENAME_LENGTH];	// empty if this population is unused
+	int protocol;
+	unsigned int nb_servers;
+	unsigned int nb_by_state [sv_state_full + 1];
+} sv_population_t;
+
+// Compact storage for a server address
+typedef union
+{
+	struct sockaddr_in v4;
+	struct sockaddr_in6 v6;
+} sv_address_t;
+
+// Server waiting for a valid infoResponse before entering the server list.
+// Kept small so that a bucket of the probation table fits in a few cache lines
+typedef struct
+{
+	sv_address_t address;
+	socklen_t addrlen;
+	time_t challenge_timeout;	// the entry is free once its challenge is obsolete
+	char challenge [CHALLENGE_MAX_LENGTH];
+} pending_server_t;
+
+// Types of changes in the server list
+typedef enum
+{
+	sv_change_added,	// the server entered the list
+	sv_change_updated,	// its state, protocol, game type or game name changed
+	sv_change_removed,	// it left the list
+} sv_change_type_t;
+
+// How a server is listed, as far as the delta requests can filter it
+typedef struct
+{
+	server_state_t state;			// sv_state_uninitialized if it isn't listed
+	int protocol;
+	char gametype [GAMETYPE_LENGTH];
+	char gamename [GAMENAME_LENGTH];
+} sv_listing_t;
+
+// Record of a change in the server list
+typedef struct
+{
+	unsigned int generation;		// generation of the list after this change
+	unsigned int sv_ind;			// slot of the server when the change occured
+	sv_change_type_t type;
+	socklen_t addrlen;
+	sv_address_t address;			// kept because the slot may be reused
+	qbyte record_size;
+	qbyte binary_record_size;
+	qbyte record [MAX_RECORD_SIZE];
+	qbyte binary_record [MAX_RECORD_SIZE];
+	sv_listing_t prev_listing;		// how the server was listed before this change
+} sv_change_t;
+
+// Server list iterator. Iterating never modifies the server list, so several
+// iterations can be in progress at the same time
+typedef struct
+{
+	unsigned int crt_ind;	// next slot to look at
+	unsigned int nb_slots;	// number of slots in use when the iteration started
+	unsigned int nb_left;	// number of slots left to look at
+} sv_iterator_t;
+
 
 // ---------- Public variables ---------- //
 
@@ -108,20 +203,129 @@ qboolean Sv_SetMaxNbServersPerAddress (unsigned int nb);
 // Initialize the server list and hash table
 qboolean Sv_Init (void);
 
+// Check if a server is allowed to talk from this address, and get its address
+// mapping if "addrmap_ptr" isn't NULL
+qboolean Sv_IsAllowedAddress (const struct sockaddr_storage* address, const addrmap_t** addrmap_ptr);
+
 // Search for a particular server in the list; add it if necessary
-// NOTE: doesn't change the current position for "Sv_GetNext"
 server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrlen, qboolean add_it);
 
-// Get the first server in the list
-server_t* Sv_GetFirst (void);
+// Search for several servers at once (without adding them), overlapping the memory
+// accesses of the lookups. The results are only hints for Sv_GetByAddrHint, since
+// the list may change before they're used. Valid until the next batched lookup
+void Sv_GetByAddrBatch (const struct sockaddr_storage* addresses, unsigned int nb_addresses, server_t** results);
+
+// Search for a server, using its result from the last batched lookup; add it if necessary
+server_t* Sv_GetByAddrHint (server_t* hint, const struct sockaddr_storage* address,
+							socklen_t addrlen, qboolean add_it);
+
+// Remove a server from the lists, in constant time
+void Sv_Remove (server_t* sv, const char* reason);
+
+// Stop sending a server to the clients until it sends a valid infoResponse again.
+// If it doesn't answer within a few seconds, it times out and is removed
+void Sv_Hide (server_t* sv, const char* reason);
+
+// Get the first active server in the list. Timed out servers are skipped but
+// not removed: only the registration path and Sv_CheckTimeouts remove servers
+const server_t* Sv_GetFirst (sv_iterator_t* iter);
+
+// Get the next active server in the list
+const server_t* Sv_GetNext (sv_iterator_t* iter);
+
+// Get the active server in a given slot, or NULL if there's none
+const server_t* Sv_GetByIndex (unsigned int sv_ind);
 
-// Get the next server in the list
-server_t* Sv_GetNext (void);
+// Get the number of slots to look at for browsing the list with Sv_GetByIndex
+unsigned int Sv_GetNbSlots (void);
+
+// Browse the server list and remove all the servers that have timed out
+void Sv_CheckTimeouts (void);
 
 // Print the list of servers to the output
 void Sv_PrintServerList (msg_level_t msg_level);
 
 
+// ---------- Public functions (change log) ---------- //
+
+// Every visible change in the server list bumps its generation number and is
+// recorded in a bounded change log, so consumers can find out what changed
+// since a given generation without browsing the whole list
+
+// Get how a server is listed right now
+void Sv_GetListing (const server_t* sv, sv_listing_t* listing);
+
+// Record a change of a server, given how it was listed before the change
+// (additions and updates are recorded by messages.c when a valid infoResponse
+// comes in, removals and hidden servers by servers.c)
+void Sv_LogChange (const server_t* sv, sv_change_type_t type, const sv_listing_t* prev_listing);
+
+// Get the current generation of the server list
+unsigned int Sv_GetGeneration (void);
+
+// Get the change which produced a given generation,
+// or NULL if it isn't in the change log (anymore)
+const sv_change_t* Sv_GetChange (unsigned int generation);
+
+
+// ---------- Public functions (probation table) ---------- //
+
+// Servers which have only sent a heartbeat are kept in a small fixed-size
+// probation table, until they answer our getinfo with a valid infoResponse.
+// When the table is full, the oldest entries are recycled
+
+// Pick the secret key of the probation table hash (call it before the chroot)
+void Sv_InitPendingKey (void);
+
+// Search for a pending server in the probation table; add it if necessary
+pending_server_t* Sv_GetPending (const struct sockaddr_storage* address, socklen_t addrlen, qboolean add_it);
+
+// Remove a server from the probation table
+void Sv_RemovePending (pending_server_t* pending);
+
+
+// ---------- Public functions (populations) ---------- //
+
+// The number of servers of each game name and protocol is kept up to date,
+// so we can give it without browsing the list
+
+// Count a server in the population of its game name and protocol
+void Sv_AddToPopulations (server_t* sv);
+
+// Stop counting a server (does nothing if it isn't counted)
+void Sv_RemoveFromPopulations (server_t* sv);
+
+// Get the populations (unused ones have an empty game name)
+const sv_population_t* Sv_GetPopulations (unsigned int* nb_populations);
+
+
+// ---------- Public functions (map index) ---------- //
+
+// Servers are indexed by map name, so requests for a given map don't need
+// to browse the whole list. Map names must be given in lowercase
+
+// Set the map name of a server, and move it in the index if necessary
+void Sv_SetMapname (server_t* sv, const char* mapname);
+
+// Get the first active server on a given map
+const server_t* Sv_GetFirstOnMap (const char* mapname);
+
+// Get the next active server on the same map
+const server_t* Sv_GetNextOnMap (const server_t* sv);
+
+
+// ---------- Public functions (infostrings) ---------- //
+
+// The last infostring of each server is stored in an arena, without any '\0'.
+// The arena is compacted when it gets full
+
+// Store the infostring of a server. Return true if it has changed
+qboolean Sv_SetInfostring (server_t* sv, const char* infostring, size_t length);
+
+// Get the infostring of a server (not '\0'-terminated) and its length
+const char* Sv_GetInfostring (const server_t* sv, size_t* length);
+
+
 // ---------- Public functions (address mappings) ---------- //
 
 // NOTE: this is a 2-step process because resolving address mappings directly
@@ -134,7 +338,4 @@ qboolean Sv_AddAddressMapping (const char* mapping);
 // Resolve the address mapping list
 qboolean Sv_ResolveAddressMappings (void);
 
-// Check if a server still is active
-qboolean Sv_IsActive (unsigned int sv_ind);
-
 #endif  // #ifndef _SERVERS_H_
@@ -25,6 +25,10 @@
 #include "common.h"
 #include "system.h"
 
+#ifdef WIN32
+#	include <wincrypt.h>
+#endif
+
 
 // ---------- Constants ---------- //
 
@@ -36,6 +40,9 @@
 // User we use by default for dropping super-user privileges
 # define DEFAULT_LOW_PRIV_USER "nobody"
 
+// Size of the huge pages we ask for (the x86 one)
+# define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
 #endif
 
 
@@ -49,6 +56,12 @@ static const char* jail_path = DEFAULT_JAIL_PATH;
 // Low privileges user
 static const char* low_priv_user = DEFAULT_LOW_PRIV_USER;
 
+// Should the big memory blocks be backed by huge pages?
+static qboolean use_huge_pages = false;
+
+// Should the big memory blocks be locked in memory?
+static qboolean lock_memory = false;
+
 #endif
 
 
@@ -74,6 +87,17 @@ const cmdlineopt_t sys_cmdline_options [] =
 		0,
 		0
 	},
+	{
+		"huge-pages",
+		NULL,
+		"Back the server list and hash tables with 2 MB huge pages, to reduce\n"
+		"   TLB misses with large server lists. Falls back to transparent huge\n"
+		"   pages, then to normal pages, if the system can't provide them",
+		{ 0, 0 },
+		'\0',
+		0,
+		0
+	},
 	{
 		"jail-path",
 		"<jail_path>",
@@ -84,6 +108,16 @@ const cmdlineopt_t sys_cmdline_options [] =
 		1,
 		1
 	},
+	{
+		"lock-memory",
+		NULL,
+		"Lock the server list and hash tables in memory, so they never get\n"
+		"   swapped out. Requires the appropriate privileges or memlock limit",
+		{ 0, 0 },
+		'\0',
+		0,
+		0
+	},
 	{
 		"user",
 		"<user>",
@@ -129,6 +163,27 @@ static void Sys_CloseSocket (socket_t sock)
 }
 
 
+/*
+====================
+Sys_SetNonBlocking
+
+Make a network socket non-blocking
+====================
+*/
+static qboolean Sys_SetNonBlocking (socket_t sock)
+{
+#ifdef WIN32
+	u_long non_blocking = 1;
+
+	return (ioctlsocket (sock, FIONBIO, &non_blocking) == 0);
+#else
+	int flags = fcntl (sock, F_GETFL, 0);
+
+	return (flags != -1 && fcntl (sock, F_SETFL, flags | O_NONBLOCK) != -1);
+#endif
+}
+
+
 /*
 ====================
 Sys_CloseAllSockets
@@ -464,6 +519,16 @@ qboolean Sys_CreateListenSockets (void)
 			return false;
 		}
 
+		// Reads and writes must never block the main loop
+		if (! Sys_SetNonBlocking (crt_sock))
+		{
+			Com_Printf (MSG_ERROR, "> ERROR: can't make the socket non-blocking (%s)\n",
+						Sys_GetLastNetErrorString ());
+
+			Sys_CloseAllSockets ();
+			return false;
+		}
+
 		listen_sock->socket = crt_sock;
 	}
 
@@ -492,10 +557,18 @@ cmdline_status_t Sys_Cmdline_Option (const cmdlineopt_t* opt, const char** param
 	if (strcmp (opt_name, "daemon") == 0)
 		daemon_state = DAEMON_STATE_REQUEST;
 
+	// Huge pages
+	else if (strcmp (opt_name, "huge-pages") == 0)
+		use_huge_pages = true;
+
 	// Jail path
 	else if (strcmp (opt_name, "jail-path") == 0)
 		jail_path = params[0];
 
+	// Memory locking
+	else if (strcmp (opt_name, "lock-memory") == 0)
+		lock_memory = true;
+
 	// Low privileges user
 	else if (strcmp (opt_name, "user") == 0)
 		low_priv_user = params[0];
@@ -767,3 +840,153 @@ qboolean Sys_IsListeningOn (sa_family_t addr_family)
 
 	return false;
 }
+
+
+/*
+====================
+Sys_GetRandomBytes
+
+Fill a buffer with unpredictable bytes (call it before the chroot).
+Return false if the system random source isn't available; the buffer
+is then filled from a predictable source, unfit for any secret
+====================
+*/
+qboolean Sys_GetRandomBytes (void* buffer, size_t size)
+{
+	qbyte* bytes = buffer;
+	size_t ind;
+
+#ifdef WIN32
+	HCRYPTPROV provider;
+
+	if (CryptAcquireContext (&provider, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT | CRYPT_SILENT))
+	{
+		BOOL result = CryptGenRandom (provider, (DWORD)size, buffer);
+
+		CryptReleaseContext (provider, 0);
+		if (result)
+			return true;
+	}
+
+	srand ((unsigned int)time (NULL) ^ ((unsigned int)GetCurrentProcessId () << 16));
+#else
+	FILE* urandom = fopen ("/dev/urandom", "rb");
+
+	if (urandom != NULL)
+	{
+		size_t nb_read = fread (buffer, 1, size, urandom);
+
+		fclose (urandom);
+		if (nb_read == size)
+			return true;
+	}
+
+	srand ((unsigned int)time (NULL) ^ ((unsigned int)getpid () << 16));
+#endif
+
+	for (ind = 0; ind < size; ind++)
+		bytes[ind] = (qbyte)(rand () >> 4);
+	return false;
+}
+
+
+/*
+====================
+Sys_GetMilliseconds
+
+Get a time in milliseconds, for measuring short durations (it wraps around)
+====================
+*/
+unsigned int Sys_GetMilliseconds (void)
+{
+#ifdef WIN32
+	return (unsigned int)GetTickCount ();
+#else
+	struct timeval now;
+
+	gettimeofday (&now, NULL);
+	return (unsigned int)now.tv_sec * 1000 + (unsigned int)now.tv_usec / 1000;
+#endif
+}
+
+
+/*
+====================
+Sys_AllocLargeBlock
+
+Allocate a big, zero-filled memory block, backed by huge pages and/or
+locked in memory if the user asked for it. Never freed.
+The block comes straight from the system, so its pages only get mapped
+(and zeroed) when they are used for the first time. That way, the memory
+footprint follows the actual number of servers, not the maximum number
+====================
+*/
+void* Sys_AllocLargeBlock (size_t size, const char* block_name)
+{
+	void* block = NULL;
+
+#ifndef WIN32
+	size_t mapped_size = size;
+
+	if (use_huge_pages)
+	{
+		mapped_size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+		// Explicit huge pages, from the pool reserved by the administrator
+		block = mmap (NULL, mapped_size, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (block != MAP_FAILED)
+			Com_Printf (MSG_DEBUG, "> %s backed by huge pages\n", block_name);
+		else
+			block = NULL;
+#endif
+	}
+
+	if (block == NULL)
+	{
+		block = mmap (NULL, mapped_size, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (block == MAP_FAILED)
+			block = NULL;
+
+		// Transparent huge pages, if the kernel is willing to give us some
+		else if (use_huge_pages)
+		{
+#ifdef MADV_HUGEPAGE
+			if (madvise (block, mapped_size, MADV_HUGEPAGE) == 0)
+				Com_Printf (MSG_DEBUG, "> %s backed by transparent huge pages\n",
+							block_name);
+			else
+#endif
+				Com_Printf (MSG_WARNING,
+							"> WARNING: can't use huge pages for the %s\n",
+							block_name);
+		}
+	}
+#endif
+
+	// Classic allocation. calloc is usually smart enough
+	// to get big blocks already zeroed from the system
+	if (block == NULL)
+	{
+		block = calloc (1, size);
+		if (block == NULL)
+			return NULL;
+	}
+
+#ifndef WIN32
+	// NOTE: locking the block maps all its pages right away
+	if (lock_memory)
+	{
+		if (mlock (block, size) != 0)
+			Com_Printf (MSG_WARNING,
+						"> WARNING: can't lock the %s in memory (%s)\n",
+						block_name, strerror (errno));
+		else
+			Com_Printf (MSG_DEBUG, "> %s locked in memory\n", block_name);
+	}
+#endif
+
+	return block;
+}
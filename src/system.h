@@ -32,10 +32,13 @@
 #else
 #	include <pwd.h>
 #	include <unistd.h>
+#	include <fcntl.h>
 #	include <netinet/in.h>
 #	include <arpa/inet.h>
 #	include <netdb.h>
 #	include <sys/socket.h>
+#	include <sys/time.h>
+#	include <sys/mman.h>
 #endif
 
 
@@ -59,10 +62,14 @@
 #	define NETERR_AFNOSUPPORT	WSAEAFNOSUPPORT
 #	define NETERR_NOPROTOOPT	WSAENOPROTOOPT
 #	define NETERR_INTR			WSAEINTR
+#	define NETERR_WOULDBLOCK	WSAEWOULDBLOCK
+#	define NETERR_NOBUFS		WSAENOBUFS
 #else
 #	define NETERR_AFNOSUPPORT	EAFNOSUPPORT
 #	define NETERR_NOPROTOOPT	ENOPROTOOPT
 #	define NETERR_INTR			EINTR
+#	define NETERR_WOULDBLOCK	EWOULDBLOCK
+#	define NETERR_NOBUFS		ENOBUFS
 #endif
 
 // Windows' CRT wants an explicit buffer size for its setvbuf() calls
@@ -173,5 +180,16 @@ const char* Sys_GetLastNetErrorString (void);
 // Are we listening on an address of the given family?
 qboolean Sys_IsListeningOn (sa_family_t addr_family); 
 
+// Fill a buffer with unpredictable bytes (call it before the chroot).
+// Return false if only a weak, predictable random source was available
+qboolean Sys_GetRandomBytes (void* buffer, size_t size);
+
+// Get a time in milliseconds, for measuring short durations (it wraps around)
+unsigned int Sys_GetMilliseconds (void);
+
+// Allocate a big, zero-filled memory block, backed by huge pages and/or
+// locked in memory if the user asked for it. Never freed
+void* Sys_AllocLargeBlock (size_t size, const char* block_name);
+
 
 #endif  // #ifndef _SYSTEM_H_